@@ -27,6 +27,26 @@
  
 #include "driver.h"
 
+/*
+ * description:		the number of characters per line of /dev/klcd, read from sysfs.
+ * @return		the number of columns, or NUM_CHARS_PER_LINE if sysfs does not tell
+*/
+static unsigned int lcd_columns(void)
+{
+	unsigned int columns, rows;
+	FILE *f;
+
+	f = fopen( "/sys/class/klcd/klcd/geometry", "r" );
+	if( f == NULL )
+		return NUM_CHARS_PER_LINE;
+
+	if( fscanf( f, "%ux%u", &columns, &rows ) != 2 || columns == 0 )
+		columns = NUM_CHARS_PER_LINE;
+
+	fclose( f );
+	return columns;
+}
+
 int main ( int argc, char *argv[] )
 {
 	struct ioctl_mesg msg;
@@ -37,6 +57,17 @@ int main ( int argc, char *argv[] )
 	char * pEnd1;
 	char * pEnd2;
 
+	unsigned int priority;
+	unsigned int mode;
+	unsigned int columns;
+	struct klcd_frame frames[4];
+	struct klcd_playlist playlist;
+	const char spinner[4] = { '|', '/', '-', 0x00 };	// the ROM has no backslash, frame 3 uses a glyph
+	const unsigned char backslash[8] = { 0x00, 0x10, 0x08, 0x04, 0x02, 0x01, 0x00, 0x00 };
+	int i;
+	struct klcd_widget_def widget;
+	struct klcd_widget_value widget_value;
+
     	if ( argc != 5 ) {
         	printf( "Usage: %s ([1]command) ([2]string to be printed) ([3]line number) ([4]nth Character offset)\n\n", argv[0] );
 		return -1;
@@ -62,6 +93,7 @@ int main ( int argc, char *argv[] )
 	}
 
 	command = *(ioctl_command);
+	columns = lcd_columns();
 	
 	switch( command ){
 		// clear the LCD display
@@ -112,6 +144,90 @@ int main ( int argc, char *argv[] )
 				perror("[ERROR] IOCTL_CURSOR_OFF \n");
 			break;
 
+		// print on the specified position (line number, nth Character) of the LCD ahead of any other update
+		case (IOCTL_SET_PRIORITY ):
+			printf("KLCD IOCTL Option: Print With Alert Priority \n");
+
+			priority = KLCD_PRIORITY_ALERT;
+			if( ioctl( fd, (unsigned int) IOCTL_SET_PRIORITY, &priority) < 0)
+				perror("[ERROR] IOCTL_SET_PRIORITY \n");
+			else if( ioctl( fd, (unsigned int) IOCTL_PRINT_WITH_POSITION, &msg) < 0)
+				perror("[ERROR] IOCTL_PRINT_WITH_POSITION \n");
+			break;
+
+		// draw a bargraph (0 to 100, 10 cells wide) at the specified position, with the value given as the string
+		case (IOCTL_DEFINE_WIDGET ):
+			printf("KLCD IOCTL Option: Bargraph \n");
+
+			memset( &widget, 0, sizeof(widget) );
+			widget.type	    = KLCD_WIDGET_BARGRAPH;
+			widget.lineNumber   = msg.lineNumber;
+			widget.nthCharacter = msg.nthCharacter;
+			widget.width	    = 10;
+			widget.max	    = 100;
+			widget.value	    = atoi( msg.kbuf );
+
+			if( ioctl( fd, (unsigned int) IOCTL_DEFINE_WIDGET, &widget) < 0)
+				perror("[ERROR] IOCTL_DEFINE_WIDGET \n");
+			break;
+
+		// move the bargraph drawn by option '7' to the value given as the string
+		case (IOCTL_SET_WIDGET ):
+			printf("KLCD IOCTL Option: Bargraph Value \n");
+
+			widget_value.id    = 0;
+			widget_value.value = atoi( msg.kbuf );
+
+			if( ioctl( fd, (unsigned int) IOCTL_SET_WIDGET, &widget_value) < 0)
+				perror("[ERROR] IOCTL_SET_WIDGET \n");
+			break;
+
+		// append the string as a new line at the bottom of the LCD, scrolling the screen up
+		case (IOCTL_SET_MODE ):
+			printf("KLCD IOCTL Option: Terminal Mode \n");
+
+			mode = KLCD_MODE_TERMINAL;
+			if( ioctl( fd, (unsigned int) IOCTL_SET_MODE, &mode) < 0)
+				perror("[ERROR] IOCTL_SET_MODE \n");
+			else if( write( fd, msg.kbuf, strlen(msg.kbuf) ) < 0 || write( fd, "\n", 1 ) < 0 )
+				perror("[ERROR] write \n");
+			break;
+
+		// replace the cells at the specified position with the string, leaving the rest of the screen as it is
+		case (PWRITE_CELLS ):
+			printf("KLCD Option: Write Cells \n");
+
+			mode = KLCD_MODE_CELLS;
+			if( ioctl( fd, (unsigned int) IOCTL_SET_MODE, &mode) < 0)
+				perror("[ERROR] IOCTL_SET_MODE \n");
+			else if( pwrite( fd, msg.kbuf, strlen(msg.kbuf), (msg.lineNumber - 1) * columns + msg.nthCharacter ) < 0 )
+				perror("[ERROR] pwrite \n");
+			break;
+
+		// play a spinner at the specified position until the next playlist ("0" as the string cancels it)
+		case (IOCTL_PLAY ):
+			printf("KLCD IOCTL Option: Spinner \n");
+
+			memset( frames, 0, sizeof(frames) );
+			for( i = 0; i < 4; i++ ){
+				frames[i].at_ms   = i * 100;
+				frames[i].cell    = (msg.lineNumber - 1) * columns + msg.nthCharacter;
+				frames[i].count   = 1;
+				frames[i].text[0] = spinner[i];
+				frames[i].glyph   = -1;
+			}
+			frames[3].glyph = 0;
+			memcpy( frames[3].rows, backslash, sizeof(backslash) );
+
+			playlist.frames    = frames;
+			playlist.count     = (strcmp( msg.kbuf, "0" ) == 0) ? 0 : 4;
+			playlist.loops     = 0;
+			playlist.period_ms = 400;
+
+			if( ioctl( fd, (unsigned int) IOCTL_PLAY, &playlist) < 0)
+				perror("[ERROR] IOCTL_PLAY \n");
+			break;
+
 		// Write call Tests
 		/* #### Test cases used for write mode robustness checking. Passed Test cases */
 		/*
@@ -22,6 +22,11 @@
 #define MAX_BUF_LENGTH  	50  /* maximum length of a buffer to copy from user space to kernel space
 				       (MUST NOT CHANGE THIS)
 				    */
+#define NUM_CHARS_PER_LINE	16  /* the number of characters per line of the default 16x2 LCD. Other LCDs show their
+				       geometry in /sys/class/klcd/<name>/geometry (file position of a cell:
+				       (line - 1) * columns + nth)
+				    */
+
 struct ioctl_mesg{
 	char kbuf[MAX_BUF_LENGTH];	// a string to be printed on the LCD
 
@@ -41,6 +46,64 @@ struct ioctl_mesg{
 #define IOCTL_PRINT_WITH_POSITION 	'3'
 #define IOCTL_CURSOR_ON			'4'
 #define IOCTL_CURSOR_OFF		'5'
+#define IOCTL_SET_PRIORITY		'6'	// argument: unsigned int, one of KLCD_PRIORITY_*
+
+#define IOCTL_DEFINE_WIDGET		'7'	// argument: struct klcd_widget_def
+#define IOCTL_SET_WIDGET		'8'	// argument: struct klcd_widget_value
+#define IOCTL_SET_MODE			'9'	// argument: unsigned int, one of KLCD_MODE_*
+#define IOCTL_PLAY			'A'	// argument: struct klcd_playlist, an empty one cancels
+
+#define KLCD_PRIORITY_NORMAL		0	// update priorities, higher is served first
+#define KLCD_PRIORITY_ALERT		1
+
+#define KLCD_MODE_LEGACY		0	// each write() replaces the screen with its first 49 bytes
+#define KLCD_MODE_TERMINAL		1	// write() streams text onto the bottom line, '\n' scrolls up
+#define KLCD_MODE_CELLS			2	// write() replaces the cells from the file position onwards
+
+#define PWRITE_CELLS			'p'	// test option (not an ioctl): pwrite() at a cell position
+
+#define KLCD_MAX_WIDGETS		8
+
+#define KLCD_WIDGET_BARGRAPH		0	// horizontal bar, 5 steps per cell
+#define KLCD_WIDGET_NUMBER		1	// right aligned decimal number
+
+struct klcd_widget_def{
+	unsigned int id;		// 0 to KLCD_MAX_WIDGETS - 1
+	unsigned int type;		// KLCD_WIDGET_BARGRAPH or KLCD_WIDGET_NUMBER
+
+	unsigned int lineNumber;	// position of the leftmost cell (the widget stays on one line)
+	unsigned int nthCharacter;
+	unsigned int width;		// the number of cells, 0 removes the widget
+
+	int min;			// KLCD_WIDGET_BARGRAPH: values for an empty and a full bar
+	int max;
+	int value;			// initial value
+};
+
+#define LCD_MAX_CELLS			80	// cells of the largest LCD (20x4 or 40x2)
+#define KLCD_MAX_FRAMES			256
+#define KLCD_PLAYLIST_GLYPHS		4	// CGRAM glyphs a playlist can define
+
+struct klcd_frame{
+	unsigned int at_ms;		// time from the start of the pass, not less than the previous frame
+	unsigned int cell;		// first cell replaced, (line - 1) * columns + nthCharacter
+	unsigned int count;		// the number of cells replaced
+	char text[LCD_MAX_CELLS];	// character codes (not UTF-8), 0x00-0x0F show the playlist glyph (code % 8)
+	int glyph;			// playlist glyph redefined by this frame, -1 for none
+	unsigned char rows[8];		// its 5x8 bitmap, top row first
+};
+
+struct klcd_playlist{
+	const struct klcd_frame *frames;
+	unsigned int count;		// the number of frames, 0 cancels the playlist
+	unsigned int loops;		// passes to play, 0 for forever
+	unsigned int period_ms;		// length of a pass, more than the time of its last frame
+};
+
+struct klcd_widget_value{
+	unsigned int id;
+	int value;
+};
 
 #define WRITE_TEST_MODE1		'W'    // check error handling
 #define WRITE_TEST_MODE2		'X'
@@ -55,5 +118,10 @@ struct ioctl_mesg{
 
 #define KLCD_IOCTL_CURSOR_ON  		_IOW( KLCD_MAGIC_NUMBER, IOCTL_CURSOR_ON, struct ioctl_mesg)
 #define KLCD_IOCTL_CURSOR_OFF  		_IOW( KLCD_MAGIC_NUMBER, IOCTL_CURSOR_OFF, struct ioctl_mesg)
+#define KLCD_IOCTL_SET_PRIORITY		_IOW( KLCD_MAGIC_NUMBER, IOCTL_SET_PRIORITY, unsigned int)
+#define KLCD_IOCTL_DEFINE_WIDGET	_IOW( KLCD_MAGIC_NUMBER, IOCTL_DEFINE_WIDGET, struct klcd_widget_def)
+#define KLCD_IOCTL_SET_WIDGET		_IOW( KLCD_MAGIC_NUMBER, IOCTL_SET_WIDGET, struct klcd_widget_value)
+#define KLCD_IOCTL_SET_MODE		_IOW( KLCD_MAGIC_NUMBER, IOCTL_SET_MODE, unsigned int)
+#define KLCD_IOCTL_PLAY			_IOW( KLCD_MAGIC_NUMBER, IOCTL_PLAY, struct klcd_playlist)
 
 #endif
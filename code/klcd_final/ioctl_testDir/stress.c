@@ -0,0 +1,805 @@
+/* description: a stress test program.
+
+		runs many concurrent writers against one LCD. Each writer opens the device on its own, switches it to
+		KLCD_MODE_CELLS and owns a range of cells, which it fills with a random mix of pwrite(), lseek() + write()
+		and IOCTL_PRINT_WITH_POSITION. Now and then a writer clears the whole display while the others wait.
+
+		At the end the screen is read back with read() and, if the emulator is in use, from its debugfs view,
+		and compared with what the writers expect. The emulator can inject delays, corrupted characters and
+		read errors meanwhile (see "fault_*" in debugfs); corrupted characters must be repaired by the scrubber
+		before the timeout for the test to pass.
+
+		While the emulator is in use, the scrubber checks a whole line every 20 ms (-i), and its settings are
+		put back afterwards. Unless -w is given, the time allowed for the repair follows from those settings.
+
+		Before the writers start, widget definitions that do not fit on a line must be refused with EINVAL.
+
+		Throughput and latency per operation type are reported. The latency of an operation is the time
+		spent in its system calls, which return once the update is queued; how late the driver actually
+		showed the updates is reported from its deadline_misses attribute. The exit status is 0 if the
+		screen matched.
+
+		build:		gcc -O2 -pthread -o stress stress.c
+		example:	./stress -t 8 -n 2000 -e /sys/kernel/debug/klcd -D 20 -C 97 -R 13
+*/
+
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "driver.h"
+
+#define MAX_CELLS		80	// the largest screen supported by the driver (4x20)
+#define MAX_THREADS		64
+#define NUM_PRIORITIES		(KLCD_PRIORITY_ALERT + 1)
+
+enum { OP_PWRITE, OP_SEEK_WRITE, OP_IOCTL, OP_CLEAR, NUM_OPS };
+
+static const char *op_names[NUM_OPS] = { "pwrite", "seek+write", "ioctl", "clear" };
+
+struct stress_config{
+	const char *device;
+	const char *debugfs;		// debugfs directory of the LCD, NULL if it is not emulated
+	char sysfs[256];		// sysfs directory of the LCD
+	int calibrate;			// calibrate the emulated LCD first and check that it needed no recovery
+	unsigned int threads;
+	unsigned int ops;		// operations per thread
+	unsigned int seed;
+	unsigned int rows;
+	unsigned int columns;
+	unsigned int clear_every;	// 1 in clear_every operations is a clear, 0 for none
+	unsigned int timeout_ms;	// how long to wait for the emulated screen to be repaired, 0 to derive it
+	int scrub_ms;			// scrub_interval during the test, -1 leaves the scrubber as it is
+
+	int fault_delay_us;		// emulator faults, -1 leaves them as they are
+	int fault_corrupt_every;
+	int fault_read_error_every;
+};
+
+struct stress_thread{
+	pthread_t thread;
+	unsigned int index;
+	unsigned int first;		// cells owned by the thread: [first, last)
+	unsigned int last;
+	unsigned int seed;
+
+	double *latency[NUM_OPS];	// latencies in microseconds
+	unsigned int count[NUM_OPS];
+	unsigned int errors;
+};
+
+struct scrub_settings{
+	unsigned int interval;		// scrub_interval in ms
+	unsigned int cells;		// scrub_cells
+};
+
+struct deadline_stats{
+	unsigned long updates[NUM_PRIORITIES];
+	unsigned long misses[NUM_PRIORITIES];
+	unsigned long latency_max_us[NUM_PRIORITIES];
+};
+
+static struct stress_config config;
+static struct stress_thread threads[MAX_THREADS];
+
+static struct scrub_settings scrub_saved;	// the scrubber settings before the test
+static int scrub_changed;			// whether scrub_restore() has to put them back
+
+static char expected[MAX_CELLS];		// the screen the writers expect, updated under clear_lock
+static pthread_rwlock_t clear_lock = PTHREAD_RWLOCK_INITIALIZER;	// held for writing by a clear, for reading by the others
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static unsigned int cells(void)
+{
+	return config.rows * config.columns;
+}
+
+/*
+ * description:		write a value to a sysfs or debugfs attribute.
+ * @return		0 on success, -1 on failure with errno set
+*/
+static int attr_write(const char *dir, const char *name, const char *value)
+{
+	char path[256];
+	ssize_t len = strlen( value );
+	int fd, ret = 0;
+
+	snprintf( path, sizeof(path), "%s/%s", dir, name );
+	fd = open( path, O_WRONLY );
+	if( fd < 0 )
+		return -1;
+	if( write( fd, value, len ) != len )
+		ret = -1;
+	close( fd );
+	return ret;
+}
+
+/*
+ * description:		read the first line of a sysfs or debugfs attribute, without its '\n'.
+ * @return		0 on success, -1 on failure
+*/
+static int attr_read(const char *dir, const char *name, char *buf, size_t size)
+{
+	char path[256];
+	FILE *f;
+
+	snprintf( path, sizeof(path), "%s/%s", dir, name );
+	f = fopen( path, "r" );
+	if( f == NULL )
+		return -1;
+	if( fgets( buf, size, f ) == NULL ){
+		fclose( f );
+		return -1;
+	}
+	fclose( f );
+	buf[strcspn( buf, "\n" )] = '\0';
+	return 0;
+}
+
+static int debugfs_write(const char *name, int value)
+{
+	char text[16];
+
+	snprintf( text, sizeof(text), "%d", value );
+	if( attr_write( config.debugfs, name, text ) < 0 ){
+		fprintf( stderr, "%s/%s: %s\n", config.debugfs, name, strerror( errno ) );
+		return -1;
+	}
+	return 0;
+}
+
+static int debugfs_read(const char *name)
+{
+	char text[16];
+
+	return ( attr_read( config.debugfs, name, text, sizeof(text) ) == 0 ) ? atoi( text ) : -1;
+}
+
+/*
+ * description:		the number of recoveries in the sysfs timing attribute.
+ * @return		the number, or -1 if it cannot be read
+*/
+static int calibrate_recoveries(char *timing, size_t size)
+{
+	const char *p;
+
+	if( attr_read( config.sysfs, "timing", timing, size ) < 0 )
+		return -1;
+	p = strstr( timing, "recoveries " );
+	return p ? atoi( p + strlen( "recoveries " ) ) : -1;
+}
+
+/*
+ * description:		calibrate the emulated LCD. The emulator follows any timing, so every step must pass
+ *			without the LCD being initialized again.
+ * @return		0 if the calibration succeeded without a recovery
+*/
+static int calibrate_check(void)
+{
+	char timing[128];
+	int before, after;
+
+	before = calibrate_recoveries( timing, sizeof(timing) );
+	if( before < 0 ){
+		fprintf( stderr, "%s/timing: cannot read the calibration state\n", config.sysfs );
+		return -1;
+	}
+
+	if( attr_write( config.sysfs, "calibrate", "1" ) < 0 ){
+		printf( "FAIL: calibration: %s\n", strerror( errno ) );
+		return -1;
+	}
+
+	after = calibrate_recoveries( timing, sizeof(timing) );
+	if( after != before ){
+		printf( "FAIL: calibration initialized the LCD again %d times\n", after - before );
+		return -1;
+	}
+
+	printf( "calibration:  %s\n", timing );
+	return 0;
+}
+
+/*
+ * description:		define widgets that do not fit on a line. The driver must refuse each of them with EINVAL,
+ *			including a width so large that the position plus the width wraps around.
+ * @return		0 if every definition was refused
+*/
+static int widget_check(int fd)
+{
+	static const struct { unsigned int nthCharacter, width; } bad[] = {
+		{ 1, 0xFFFFFFFF },		// 1 + width wraps to 0
+		{ 0, 0xFFFFFFFF },
+		{ 0, MAX_CELLS + 1 },
+	};
+	struct klcd_widget_def def;
+	unsigned int i;
+	int ret = 0;
+
+	for( i = 0; i < sizeof(bad) / sizeof(bad[0]); i++ ){
+		memset( &def, 0, sizeof(def) );
+		def.type         = KLCD_WIDGET_NUMBER;
+		def.lineNumber   = 1;
+		def.nthCharacter = bad[i].nthCharacter;
+		def.width        = bad[i].width;
+
+		if( ioctl( fd, (unsigned int) IOCTL_DEFINE_WIDGET, &def ) == 0 || errno != EINVAL ){
+			printf( "FAIL: widget at %u with width %u was not refused with EINVAL\n", def.nthCharacter, def.width );
+			ret = -1;
+		}
+	}
+
+	if( ret == 0 )
+		printf( "widgets:      oversized definitions refused\n" );
+	return ret;
+}
+
+/*
+ * description:		read an unsigned number from a sysfs attribute of the LCD.
+ * @return		0 on success, -1 on failure
+*/
+static int sysfs_read_uint(const char *name, unsigned int *value)
+{
+	char text[32];
+
+	if( attr_read( config.sysfs, name, text, sizeof(text) ) < 0 ){
+		fprintf( stderr, "%s/%s: %s\n", config.sysfs, name, strerror( errno ) );
+		return -1;
+	}
+	*value = strtoul( text, NULL, 10 );
+	return 0;
+}
+
+static int sysfs_write_uint(const char *name, unsigned int value)
+{
+	char text[16];
+
+	snprintf( text, sizeof(text), "%u", value );
+	if( attr_write( config.sysfs, name, text ) < 0 ){
+		fprintf( stderr, "%s/%s: %s\n", config.sysfs, name, strerror( errno ) );
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * description:		make the scrubber check a whole line every config.scrub_ms for the test, so that corrupted
+ *			cells are repaired soon after the faults stop. scrub_restore() puts the old settings back.
+ * @return		the time in ms the scrubber takes to check the whole screen, 0 if it is stopped or unknown
+*/
+static unsigned int scrub_setup(void)
+{
+	struct scrub_settings use;
+
+	if( sysfs_read_uint( "scrub_interval", &scrub_saved.interval ) < 0 ||
+	    sysfs_read_uint( "scrub_cells", &scrub_saved.cells ) < 0 )
+		return 0;
+	use = scrub_saved;
+
+	if( config.scrub_ms >= 0 ){
+		scrub_changed = 1;
+		if( sysfs_write_uint( "scrub_cells", config.columns ) == 0 )
+			use.cells = config.columns;
+		if( sysfs_write_uint( "scrub_interval", config.scrub_ms ) == 0 )
+			use.interval = config.scrub_ms;
+	}
+
+	printf( "scrubber:     %u cells every %u ms\n", use.cells, use.interval );
+	if( use.interval == 0 || use.cells == 0 )
+		return 0;
+	return ( cells() + use.cells - 1 ) / use.cells * use.interval;
+}
+
+static void scrub_restore(void)
+{
+	if( !scrub_changed )
+		return;
+	sysfs_write_uint( "scrub_cells", scrub_saved.cells );
+	sysfs_write_uint( "scrub_interval", scrub_saved.interval );
+	scrub_changed = 0;
+}
+
+/*
+ * description:		read the driver's deadline_misses attribute, one line per priority.
+ * @return		0 on success, -1 on failure
+*/
+static int deadline_read(struct deadline_stats *stats)
+{
+	char path[sizeof(config.sysfs) + 32];
+	char line[128];
+	unsigned int priority, found = 0;
+	unsigned long updates, misses, latency;
+	FILE *f;
+
+	snprintf( path, sizeof(path), "%s/deadline_misses", config.sysfs );
+	f = fopen( path, "r" );
+	if( f == NULL )
+		return -1;
+
+	memset( stats, 0, sizeof(*stats) );
+	while( fgets( line, sizeof(line), f ) ){
+		if( sscanf( line, "priority %u updates %lu misses %lu latency_max_us %lu",
+			    &priority, &updates, &misses, &latency ) != 4 || priority >= NUM_PRIORITIES )
+			continue;
+		stats->updates[priority]        = updates;
+		stats->misses[priority]         = misses;
+		stats->latency_max_us[priority] = latency;
+		found++;
+	}
+	fclose( f );
+
+	return found ? 0 : -1;
+}
+
+/*
+ * description:		report how many updates the driver showed later than its deadline_ms during the test.
+*/
+static void deadline_report(const struct deadline_stats *before)
+{
+	struct deadline_stats after;
+	unsigned int priority;
+
+	if( deadline_read( &after ) < 0 ){
+		printf( "deadlines:    %s/deadline_misses cannot be read\n", config.sysfs );
+		return;
+	}
+
+	for( priority = 0; priority < NUM_PRIORITIES; priority++ )
+		printf( "deadlines:    priority %u: %lu updates shown, %lu late, worst latency since load %lu us\n",
+			priority, after.updates[priority] - before->updates[priority],
+			after.misses[priority] - before->misses[priority], after.latency_max_us[priority] );
+}
+
+/*
+ * description:		read the emulated screen from "<debugfs>/emul", one "|...|" line per row.
+ * @return		0 on success, -1 on failure
+*/
+static int emul_read_screen(char *screen)
+{
+	char path[256];
+	char line[128];
+	unsigned int row = 0;
+	FILE *f;
+
+	snprintf( path, sizeof(path), "%s/emul", config.debugfs );
+	f = fopen( path, "r" );
+	if( f == NULL ){
+		perror( path );
+		return -1;
+	}
+
+	while( row < config.rows && fgets( line, sizeof(line), f ) ){
+		if( line[0] != '|' || strlen( line ) < config.columns + 2 || line[config.columns + 1] != '|' )
+			continue;
+		memcpy( screen + row * config.columns, line + 1, config.columns );
+		row++;
+	}
+	fclose( f );
+
+	return ( row == config.rows ) ? 0 : -1;
+}
+
+static void random_text(char *text, unsigned int len, unsigned int *seed)
+{
+	static const char charset[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+	unsigned int i;
+
+	for( i = 0; i < len; i++ )
+		text[i] = charset[ rand_r( seed ) % (sizeof(charset) - 1) ];
+}
+
+/*
+ * description:		one operation of a writer, timed from the first to the last system call.
+ * @return		the operation type, its latency is stored in *latency
+*/
+static int stress_op(struct stress_thread *t, int fd, double *latency)
+{
+	struct ioctl_mesg msg;
+	char text[MAX_BUF_LENGTH];
+	unsigned int start, len, room;
+	int op, ret = 0;
+	double begin;
+
+	if( config.clear_every && rand_r( &t->seed ) % config.clear_every == 0 )
+		op = OP_CLEAR;
+	else
+		op = rand_r( &t->seed ) % OP_CLEAR;
+
+	start = t->first + rand_r( &t->seed ) % (t->last - t->first);
+	room  = t->last - start;
+	if( room > MAX_BUF_LENGTH - 1 )
+		room = MAX_BUF_LENGTH - 1;
+	len = 1 + rand_r( &t->seed ) % room;
+	random_text( text, len, &t->seed );
+
+	if( op == OP_CLEAR )
+		pthread_rwlock_wrlock( &clear_lock );
+	else
+		pthread_rwlock_rdlock( &clear_lock );
+
+	begin = now_us();
+
+	switch( op ){
+		case OP_PWRITE:
+			ret = ( pwrite( fd, text, len, start ) == (ssize_t) len ) ? 0 : -1;
+			break;
+
+		case OP_SEEK_WRITE:
+			if( lseek( fd, start, SEEK_SET ) != (off_t) start )
+				ret = -1;
+			else
+				ret = ( write( fd, text, len ) == (ssize_t) len ) ? 0 : -1;
+			break;
+
+		case OP_IOCTL:
+			memset( &msg, 0, sizeof(msg) );
+			memcpy( msg.kbuf, text, len );
+			msg.lineNumber   = start / config.columns + 1;
+			msg.nthCharacter = start % config.columns;
+			ret = ioctl( fd, (unsigned int) IOCTL_PRINT_WITH_POSITION, &msg );
+			break;
+
+		case OP_CLEAR:
+			memset( &msg, 0, sizeof(msg) );
+			ret = ioctl( fd, (unsigned int) IOCTL_CLEAR_DISPLAY, &msg );
+			break;
+	}
+
+	*latency = now_us() - begin;
+
+	if( ret < 0 ){
+		t->errors++;
+		fprintf( stderr, "writer %u: %s failed: %s\n", t->index, op_names[op], strerror( errno ) );
+	}
+	else if( op == OP_CLEAR )
+		memset( expected, ' ', cells() );
+	else
+		memcpy( expected + start, text, len );		// only this thread writes its cells
+
+	pthread_rwlock_unlock( &clear_lock );
+	return op;
+}
+
+static void *stress_writer(void *arg)
+{
+	struct stress_thread *t = arg;
+	unsigned int mode = KLCD_MODE_CELLS;
+	unsigned int i;
+	double latency;
+	int fd, op;
+
+	fd = open( config.device, O_RDWR );
+	if( fd < 0 ){
+		perror( config.device );
+		t->errors++;
+		return NULL;
+	}
+
+	if( ioctl( fd, (unsigned int) IOCTL_SET_MODE, &mode ) < 0 ){
+		perror( "IOCTL_SET_MODE" );
+		t->errors++;
+		close( fd );
+		return NULL;
+	}
+
+	for( i = 0; i < config.ops; i++ ){
+		op = stress_op( t, fd, &latency );
+		t->latency[op][ t->count[op]++ ] = latency;
+	}
+
+	close( fd );
+	return NULL;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return ( x > y ) - ( x < y );
+}
+
+static double percentile(const double *sorted, unsigned int n, double p)
+{
+	unsigned int i = (unsigned int) (p * (n - 1) + 0.5);
+
+	return sorted[i];
+}
+
+static void report(double elapsed_us, double drain_us)
+{
+	unsigned int op, i, n, total = 0, errors = 0;
+	double *all;
+
+	for( i = 0; i < config.threads; i++ )
+		errors += threads[i].errors;
+
+	printf( "%-12s %8s %10s %10s %10s %10s\n", "operation", "count", "p50 us", "p99 us", "p99.9 us", "max us" );
+
+	for( op = 0; op < NUM_OPS; op++ ){
+		n = 0;
+		for( i = 0; i < config.threads; i++ )
+			n += threads[i].count[op];
+		if( n == 0 )
+			continue;
+
+		all = malloc( n * sizeof(double) );
+		if( all == NULL )
+			return;
+
+		n = 0;
+		for( i = 0; i < config.threads; i++ ){
+			memcpy( all + n, threads[i].latency[op], threads[i].count[op] * sizeof(double) );
+			n += threads[i].count[op];
+		}
+		qsort( all, n, sizeof(double), compare_double );
+
+		printf( "%-12s %8u %10.1f %10.1f %10.1f %10.1f\n", op_names[op], n,
+			percentile( all, n, 0.50 ), percentile( all, n, 0.99 ), percentile( all, n, 0.999 ), all[n - 1] );
+
+		total += n;
+		free( all );
+	}
+
+	printf( "(time in the system calls, which return once the update is queued)\n" );
+
+	printf( "\n%u operations by %u writers in %.1f ms: %.0f ops/s, %u errors\n",
+		total, config.threads, elapsed_us / 1e3, total / (elapsed_us / 1e6), errors );
+	printf( "queue drained by fsync() in %.1f ms\n", drain_us / 1e3 );
+}
+
+static void print_mismatch(const char *what, const char *screen)
+{
+	unsigned int row;
+
+	printf( "FAIL: %s does not match\n", what );
+	for( row = 0; row < config.rows; row++ )
+		printf( "  expected |%.*s|   got |%.*s|\n", config.columns, expected + row * config.columns,
+			config.columns, screen + row * config.columns );
+}
+
+/*
+ * description:		compare the screen with the expected one, through read() and the emulator's debugfs view.
+ * @return		0 if both match
+*/
+static int verify(int fd)
+{
+	char screen[MAX_CELLS];
+	double deadline;
+	int ret = 0;
+
+	if( pread( fd, screen, cells(), 0 ) != (ssize_t) cells() ){
+		perror( "read" );
+		return -1;
+	}
+	if( memcmp( screen, expected, cells() ) != 0 ){
+		print_mismatch( "read()", screen );
+		ret = -1;
+	}
+	else
+		printf( "read():       match\n" );
+
+	if( config.debugfs == NULL )
+		return ret;
+
+	/* Characters corrupted by the emulator stay wrong on the screen until the scrubber gets round to them. */
+	deadline = now_us() + config.timeout_ms * 1e3;
+	for( ;; ){
+		if( emul_read_screen( screen ) < 0 )
+			return -1;
+		if( memcmp( screen, expected, cells() ) == 0 ){
+			printf( "emul screen:  match\n" );
+			break;
+		}
+		if( now_us() >= deadline ){
+			print_mismatch( "emulated screen", screen );
+			ret = -1;
+			break;
+		}
+		usleep( 10000 );
+	}
+
+	return ret;
+}
+
+static void usage(const char *name)
+{
+	fprintf( stderr,
+		"usage: %s [options]\n"
+		"  -d device      LCD device (default /dev/klcd)\n"
+		"  -t threads     concurrent writers (default 4)\n"
+		"  -n ops         operations per writer (default 1000)\n"
+		"  -s seed        random seed (default: the time)\n"
+		"  -g RxC         screen geometry (default 2x16)\n"
+		"  -c n           1 in n operations clears the display, 0 for none (default 100)\n"
+		"  -S dir         sysfs directory of the LCD (default /sys/class/klcd/<device name>)\n"
+		"  -e dir         debugfs directory of an emulated LCD, e.g. /sys/kernel/debug/klcd\n"
+		"  -K             emulator: calibrate first, which must pass without a recovery\n"
+		"  -D us          emulator: delay added to every nibble\n"
+		"  -C n           emulator: corrupt every nth character written\n"
+		"  -R n           emulator: fail every nth read\n"
+		"  -i ms          emulator: scrub_interval during the test, -1 to leave it (default 20)\n"
+		"  -w ms          time for the emulated screen to be repaired (default: from the scrubber settings)\n",
+		name );
+}
+
+int main ( int argc, char *argv[] )
+{
+	struct ioctl_mesg msg;
+	struct deadline_stats deadlines;
+	double begin, elapsed, drain;
+	unsigned int i, share, op, sweep_ms;
+	int opt, fd, ret, have_deadlines;
+
+	config.device       = "/dev/klcd";
+	config.threads      = 4;
+	config.ops          = 1000;
+	config.seed         = time( NULL );
+	config.rows         = 2;
+	config.columns      = NUM_CHARS_PER_LINE;
+	config.clear_every  = 100;
+	config.timeout_ms   = 0;
+	config.scrub_ms     = 20;
+	config.fault_delay_us = config.fault_corrupt_every = config.fault_read_error_every = -1;
+
+	while( (opt = getopt( argc, argv, "d:t:n:s:g:c:S:e:KD:C:R:i:w:h" )) != -1 ){
+		switch( opt ){
+			case 'd':	config.device      = optarg;			break;
+			case 't':	config.threads     = strtoul( optarg, NULL, 10 );	break;
+			case 'n':	config.ops         = strtoul( optarg, NULL, 10 );	break;
+			case 's':	config.seed        = strtoul( optarg, NULL, 10 );	break;
+			case 'c':	config.clear_every = strtoul( optarg, NULL, 10 );	break;
+			case 'S':	snprintf( config.sysfs, sizeof(config.sysfs), "%s", optarg );	break;
+			case 'e':	config.debugfs     = optarg;			break;
+			case 'K':	config.calibrate   = 1;				break;
+			case 'D':	config.fault_delay_us         = atoi( optarg );	break;
+			case 'C':	config.fault_corrupt_every    = atoi( optarg );	break;
+			case 'R':	config.fault_read_error_every = atoi( optarg );	break;
+			case 'i':	config.scrub_ms    = atoi( optarg );		break;
+			case 'w':	config.timeout_ms  = strtoul( optarg, NULL, 10 );	break;
+			case 'g':
+				if( sscanf( optarg, "%ux%u", &config.rows, &config.columns ) != 2 ){
+					usage( argv[0] );
+					return 2;
+				}
+				break;
+			default:
+				usage( argv[0] );
+				return 2;
+		}
+	}
+
+	if( config.rows == 0 || config.columns == 0 || cells() > MAX_CELLS ){
+		fprintf( stderr, "ERR: unsupported geometry %ux%u\n", config.rows, config.columns );
+		return 2;
+	}
+	if( config.threads == 0 || config.threads > MAX_THREADS || config.threads > cells() ){
+		fprintf( stderr, "ERR: 1 to %u writers are supported\n", cells() < MAX_THREADS ? cells() : MAX_THREADS );
+		return 2;
+	}
+	if( (config.calibrate || config.fault_delay_us >= 0 || config.fault_corrupt_every >= 0 || config.fault_read_error_every >= 0) && config.debugfs == NULL ){
+		fprintf( stderr, "ERR: -K and faults need the emulator's debugfs directory (-e)\n" );
+		return 2;
+	}
+	if( config.sysfs[0] == '\0' )
+		snprintf( config.sysfs, sizeof(config.sysfs), "/sys/class/klcd/%s",
+			  strrchr( config.device, '/' ) ? strrchr( config.device, '/' ) + 1 : config.device );
+
+	printf( "%s: %u writers x %u operations, seed %u\n", config.device, config.threads, config.ops, config.seed );
+
+	fd = open( config.device, O_RDWR );
+	if( fd < 0 ){
+		perror( config.device );
+		return 1;
+	}
+
+	// start from a known screen
+	memset( &msg, 0, sizeof(msg) );
+	if( ioctl( fd, (unsigned int) IOCTL_CLEAR_DISPLAY, &msg ) < 0 ){
+		perror( "clear" );
+		return 1;
+	}
+	memset( expected, ' ', cells() );
+
+	if( config.calibrate && calibrate_check() < 0 ){
+		close( fd );
+		printf( "FAIL\n" );
+		return 1;
+	}
+
+	/* Corrupted cells are only repaired by the scrubber, so the time to wait for the emulated screen
+	   depends on how fast it goes round the screen: allow 10 rounds, as failed reads make it skip cells. */
+	if( config.debugfs ){
+		sweep_ms = scrub_setup();
+		if( sweep_ms == 0 && config.fault_corrupt_every > 0 )
+			fprintf( stderr, "warning: the scrubber is stopped, corrupted cells will not be repaired\n" );
+		if( config.timeout_ms == 0 )
+			config.timeout_ms = sweep_ms ? 1000 + 10 * sweep_ms : 5000;
+	}
+	else if( config.timeout_ms == 0 )
+		config.timeout_ms = 5000;
+
+	if( widget_check( fd ) < 0 ){
+		scrub_restore();
+		close( fd );
+		printf( "FAIL\n" );
+		return 1;
+	}
+
+	have_deadlines = ( deadline_read( &deadlines ) == 0 );
+
+	if( config.fault_delay_us >= 0 )
+		debugfs_write( "fault_delay_us", config.fault_delay_us );
+	if( config.fault_corrupt_every >= 0 )
+		debugfs_write( "fault_corrupt_every", config.fault_corrupt_every );
+	if( config.fault_read_error_every >= 0 )
+		debugfs_write( "fault_read_error_every", config.fault_read_error_every );
+
+	// every writer owns an equal share of the cells, the last one takes the remainder
+	share = cells() / config.threads;
+	for( i = 0; i < config.threads; i++ ){
+		threads[i].index = i;
+		threads[i].first = i * share;
+		threads[i].last  = ( i == config.threads - 1 ) ? cells() : (i + 1) * share;
+		threads[i].seed  = config.seed + i * 7919;
+
+		for( op = 0; op < NUM_OPS; op++ ){
+			threads[i].latency[op] = malloc( config.ops * sizeof(double) );
+			if( threads[i].latency[op] == NULL ){
+				fprintf( stderr, "ERR: out of memory\n" );
+				scrub_restore();
+				return 1;
+			}
+		}
+	}
+
+	begin = now_us();
+	for( i = 0; i < config.threads; i++ )
+		pthread_create( &threads[i].thread, NULL, stress_writer, &threads[i] );
+	for( i = 0; i < config.threads; i++ )
+		pthread_join( threads[i].thread, NULL );
+	elapsed = now_us() - begin;
+
+	// the writes have been queued, fsync() waits until they have reached the LCD
+	begin = now_us();
+	if( fsync( fd ) < 0 )
+		perror( "fsync" );
+	drain = now_us() - begin;
+
+	report( elapsed, drain );
+	if( have_deadlines )
+		deadline_report( &deadlines );
+
+	// stop injecting before reading back, so the scrubber can catch up
+	if( config.fault_corrupt_every > 0 )
+		debugfs_write( "fault_corrupt_every", 0 );
+	if( config.fault_read_error_every > 0 )
+		debugfs_write( "fault_read_error_every", 0 );
+	if( config.fault_delay_us > 0 )
+		debugfs_write( "fault_delay_us", 0 );
+	if( config.debugfs )
+		printf( "faults injected: %d\n", debugfs_read( "fault_injected" ) );
+
+	ret = verify( fd );
+	scrub_restore();
+	for( i = 0; i < config.threads; i++ )
+		ret |= threads[i].errors ? -1 : 0;
+
+	close( fd );
+	printf( "%s\n", ret == 0 ? "PASS" : "FAIL" );
+	return ret == 0 ? 0 : 1;
+}
@@ -21,6 +21,8 @@
 #include <linux/fs.h>
 #include <linux/device.h>
 #include <linux/cdev.h>
+#include <linux/kref.h>
+#include <linux/rwsem.h>
 
 #include <asm/uaccess.h>
 #include <linux/init.h>
@@ -28,15 +30,76 @@
 #include <linux/gpio.h>  // linux gpio interface
 
 #include <linux/delay.h> // delay
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/llist.h>
+#include <linux/seqlock.h>
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/wait.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/cpumask.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/jiffies.h>
+#include <linux/slab.h>
+#include <linux/bitmap.h>
+#include <linux/kfifo.h>
+#include <linux/uio.h>
+#include <linux/poll.h>
+#include <linux/math64.h>
+#include <linux/string.h>
+#include <linux/platform_device.h>
+#include <linux/of.h>
+#include <linux/of_gpio.h>
+#include <linux/idr.h>
 
 #include "klcd.h"
 
 #define DRIVER_AUTHOR	"Hong Moon <hsm5xw.gmail.com>"
-#define DRIVER_DESC	"a 16x2 character LCD (HD44780 LCD controller) driver with 4 bit mode"	
+#define DRIVER_DESC	"a character LCD (HD44780 LCD controller) driver with 4 bit mode, for up to 8 LCDs"	
 
 
 // ************ Core Functions ************************************
 
+static bool rw_wired;
+module_param( rw_wired, bool, S_IRUGO );
+MODULE_PARM_DESC( rw_wired, "the R/W line of the legacy LCD is connected to LCD_RW_PIN_NUMBER instead of ground, so the LCD can be read" );
+
+static unsigned int nibble_us = 2000;
+module_param( nibble_us, uint, S_IRUGO );
+MODULE_PARM_DESC( nibble_us, "delay in us before every 4-bit transfer (default 2000, safe for any HD44780), unless the device tree sets klcd,nibble-us" );
+
+static unsigned int pulse_us = 5;
+module_param( pulse_us, uint, S_IRUGO );
+MODULE_PARM_DESC( pulse_us, "RS setup time and E pulse width in us (default 5), unless the device tree sets klcd,pulse-us" );
+
+/*
+ * description:		wait for a bus delay. Short delays are busy-waited, since sleeping that briefly is not precise.
+ * @param us		the delay in us
+*/
+static void lcd_delay_us(unsigned int us)
+{
+	if( us <= LCD_UDELAY_MAX_US )
+		udelay( us );
+	else
+		usleep_range( us, us + us / 2 );
+}
+
+/*
+ * description:		keep a bus timing within LCD_TIMING_MIN_US to LCD_NIBBLE_MAX_US / LCD_PULSE_MAX_US, so a
+ *			bad setting cannot stall the bus thread for seconds per nibble.
+*/
+static void lcd_timing_clamp(struct klcd_timing *timing)
+{
+	timing->nibble_us = clamp_t( unsigned int, timing->nibble_us, LCD_TIMING_MIN_US, LCD_NIBBLE_MAX_US );
+	timing->pulse_us  = clamp_t( unsigned int, timing->pulse_us,  LCD_TIMING_MIN_US, LCD_PULSE_MAX_US );
+}
+
 /*
  * description:		 Set up a GPIO pin for LCD.
  * 
@@ -58,6 +121,7 @@ static int lcd_pin_setup(unsigned int pin_number)
 	ret = gpio_export( pin_number, 0);
 	if( ret != 0 )	{
 		printk( KERN_DEBUG "ERR: Failed to export GPIO pin %d \n", pin_number );
+		gpio_free( pin_number );
 		return ret;
 	}
 
@@ -65,6 +129,8 @@ static int lcd_pin_setup(unsigned int pin_number)
 	ret = gpio_direction_output( pin_number, gpio_direction);
 	if( ret != 0 )	{
 		printk( KERN_DEBUG "ERR: Failed to set GPIO pin direction %d \n", pin_number );	
+		gpio_unexport( pin_number );
+		gpio_free( pin_number );
 		return ret;
 	}
 
@@ -78,16 +144,33 @@ static int lcd_pin_setup(unsigned int pin_number)
 /*
  * description: Set up all GPIO pins needed for LCD
  * 
+ * @return	0 on success, or the error of the first pin that failed (the pins set up before it are released)
 */
-static void lcd_pin_setup_All()
+static int lcd_pin_setup_All(struct klcd_device *lcd)
 {
-	lcd_pin_setup(LCD_RS_PIN_NUMBER);
-	lcd_pin_setup(LCD_E_PIN_NUMBER);
+	int pins[7];
+	unsigned int count = 0;
+	unsigned int i;
+	int ret;
+
+	pins[count++] = lcd->pins.rs;
+	pins[count++] = lcd->pins.e;
+	for( i = 0; i < 4; i++ )
+		pins[count++] = lcd->pins.db[i];
+	if( lcd->rw_wired )
+		pins[count++] = lcd->pins.rw;		// driven low (write) except while reading
+
+	for( i = 0; i < count; i++ )
+	{
+		ret = lcd_pin_setup( pins[i] );
+		if( ret < 0 ){
+			while( i-- > 0 )
+				lcd_pin_release( pins[i] );
+			return ret;
+		}
+	}
 
-	lcd_pin_setup(LCD_DB4_PIN_NUMBER);
-	lcd_pin_setup(LCD_DB5_PIN_NUMBER);
-	lcd_pin_setup(LCD_DB6_PIN_NUMBER);
-	lcd_pin_setup(LCD_DB7_PIN_NUMBER);
+	return 0;
 }
 
 /*
@@ -105,529 +188,4674 @@ static void lcd_pin_release(unsigned int pin_number)
  * description: Release all GPIO pins needed for LCD
  * 
 */
-static void lcd_pin_release_All()
+static void lcd_pin_release_All(struct klcd_device *lcd)
 {
-	lcd_pin_release(LCD_RS_PIN_NUMBER);
-	lcd_pin_release(LCD_E_PIN_NUMBER);
+	unsigned int i;
 
-	lcd_pin_release(LCD_DB4_PIN_NUMBER);
-	lcd_pin_release(LCD_DB5_PIN_NUMBER);
-	lcd_pin_release(LCD_DB6_PIN_NUMBER);
-	lcd_pin_release(LCD_DB7_PIN_NUMBER);
+	lcd_pin_release(lcd->pins.rs);
+	lcd_pin_release(lcd->pins.e);
+
+	for( i = 0; i < 4; i++ )
+		lcd_pin_release(lcd->pins.db[i]);
+
+	if( lcd->rw_wired )
+		lcd_pin_release(lcd->pins.rw);
 }
 
 /*
- * description:		 send a 4-bit command to the HD44780 LCD controller.
+ * description:		put a 4-bit value on DB7-DB4 and clock it into the HD44780 LCD controller.
  *
- * @param command	 command to be sent to the LCD controller. Only the upper 4 bits of this command is used.
+ * @param rs_mode	either RS_COMMAND_MODE or RS_DATA_MODE
+ * @param nibble	value to be sent. Only the upper 4 bits are used.
 */
-static void lcd_instruction(char command)
+static void lcd_gpio_write_nibble(struct klcd_device *lcd, unsigned int rs_mode, char nibble)
 {
 	int db7_data = 0;
 	int db6_data = 0;
 	int db5_data = 0;
 	int db4_data = 0;
+	ktime_t start = ktime_get();
 
-	usleep_range(2000, 3000);	// added delay instead of busy checking
+	lcd_delay_us( lcd->timing.nibble_us );	// added delay instead of busy checking
 
 	// Upper 4 bit data (DB7 to DB4)
-	db7_data = ( (command)&(0x1 << 7) ) >> (7) ;
-	db6_data = ( (command)&(0x1 << 6) ) >> (6) ;
-	db5_data = ( (command)&(0x1 << 5) ) >> (5) ;
-	db4_data = ( (command)&(0x1 << 4) ) >> (4) ;
+	db7_data = ( (nibble)&(0x1 << 7) ) >> (7) ;
+	db6_data = ( (nibble)&(0x1 << 6) ) >> (6) ;
+	db5_data = ( (nibble)&(0x1 << 5) ) >> (5) ;
+	db4_data = ( (nibble)&(0x1 << 4) ) >> (4) ;
 
-	gpio_set_value(LCD_DB7_PIN_NUMBER, db7_data);
-	gpio_set_value(LCD_DB6_PIN_NUMBER, db6_data);
-	gpio_set_value(LCD_DB5_PIN_NUMBER, db5_data);
-	gpio_set_value(LCD_DB4_PIN_NUMBER, db4_data);
+	gpio_set_value(lcd->pins.db[3], db7_data);
+	gpio_set_value(lcd->pins.db[2], db6_data);
+	gpio_set_value(lcd->pins.db[1], db5_data);
+	gpio_set_value(lcd->pins.db[0], db4_data);
 
-	// Set to command mode
-	gpio_set_value(LCD_RS_PIN_NUMBER, RS_COMMAND_MODE);
-	usleep_range(5, 10);
+	// Set to command or data mode
+	gpio_set_value(lcd->pins.rs, rs_mode);
+	lcd_delay_us( lcd->timing.pulse_us );
 
 	// Simulate falling edge triggered clock
-	gpio_set_value(LCD_E_PIN_NUMBER, 1);
-	usleep_range(5, 10);
-	gpio_set_value(LCD_E_PIN_NUMBER, 0);
-}
+	gpio_set_value(lcd->pins.e, 1);
+	lcd_delay_us( lcd->timing.pulse_us );
+	gpio_set_value(lcd->pins.e, 0);
 
+	lcd_bus_record_timing( lcd, start, (lcd->timing.nibble_us + 2 * lcd->timing.pulse_us) * NSEC_PER_USEC );
+}
 
 /*
- * description:		send a 1-byte ASCII character data to the HD44780 LCD controller.
- * @param data		a 1-byte data to be sent to the LCD controller. Both the upper 4 bits and the lower 4 bits are used.
+ * description:		send a stream of full bytes over the GPIO pins, upper 4 bits first.
+ *
+ * @param rs_mode	either RS_COMMAND_MODE or RS_DATA_MODE
+ * @param bytes		bytes to be sent
+ * @param count		the number of bytes
 */
-static void lcd_data(char data)
+static void lcd_gpio_write_bytes(struct klcd_device *lcd, unsigned int rs_mode, const char *bytes, unsigned int count)
 {
-	int db7_data = 0;
-	int db6_data = 0;
-	int db5_data = 0;
-	int db4_data = 0;
+	unsigned int i;
 
-	// Part 1.  Upper 4 bit data (from bit 7 to bit 4)
-	usleep_range(2000, 3000); 	// added delay instead of busy checking
-
-	db7_data = ( (data)&(0x1 << 7) ) >> (7) ;
-	db6_data = ( (data)&(0x1 << 6) ) >> (6) ;
-	db5_data = ( (data)&(0x1 << 5) ) >> (5) ;
-	db4_data = ( (data)&(0x1 << 4) ) >> (4) ;
-
-	gpio_set_value(LCD_DB7_PIN_NUMBER, db7_data);
-	gpio_set_value(LCD_DB6_PIN_NUMBER, db6_data);
-	gpio_set_value(LCD_DB5_PIN_NUMBER, db5_data);
-	gpio_set_value(LCD_DB4_PIN_NUMBER, db4_data);
-
-	// Part 1. Set to data mode
-	gpio_set_value(LCD_RS_PIN_NUMBER, RS_DATA_MODE);
-	usleep_range(5, 10);
+	for( i = 0; i < count; i++ )
+	{
+		lcd_gpio_write_nibble( lcd, rs_mode, bytes[i] & 0xF0 );	// Part 1. Upper 4 bit data (from bit 7 to bit 4)
+		lcd_gpio_write_nibble( lcd, rs_mode, bytes[i] << 4 );	// Part 2. Lower 4 bit data (from bit 3 to bit 0)
+	}
+}
 
-	// Part 1. Simulate falling edge triggered clock
-	gpio_set_value(LCD_E_PIN_NUMBER, 1);
-	usleep_range(5, 10);
-	gpio_set_value(LCD_E_PIN_NUMBER, 0);	
+/*
+ * description:		clock one 4-bit value out of the HD44780 LCD controller. DB7-DB4 must be inputs.
+ * @return		the value read in the upper 4 bits
+*/
+static char lcd_gpio_read_nibble(struct klcd_device *lcd)
+{
+	char nibble;
+	ktime_t start = ktime_get();
 
+	lcd_delay_us( lcd->timing.nibble_us );	// added delay instead of busy checking
 
-	// Part 2. Lower 4 bit data (from bit 3 to bit 0)
-	usleep_range(2000, 3000);	// added delay instead of busy checking
+	gpio_set_value(lcd->pins.e, 1);
+	lcd_delay_us( lcd->timing.pulse_us );	// data is valid while E is high
 
-	db7_data = ( (data)&(0x1 << 3) ) >> (3) ;
-	db6_data = ( (data)&(0x1 << 2) ) >> (2) ;
-	db5_data = ( (data)&(0x1 << 1) ) >> (1) ;
-	db4_data = ( (data)&(0x1)      )        ;
+	nibble = (gpio_get_value(lcd->pins.db[3]) << 7) | (gpio_get_value(lcd->pins.db[2]) << 6) |
+		 (gpio_get_value(lcd->pins.db[1]) << 5) | (gpio_get_value(lcd->pins.db[0]) << 4);
 
-	gpio_set_value(LCD_DB7_PIN_NUMBER, db7_data);
-	gpio_set_value(LCD_DB6_PIN_NUMBER, db6_data);
-	gpio_set_value(LCD_DB5_PIN_NUMBER, db5_data);
-	gpio_set_value(LCD_DB4_PIN_NUMBER, db4_data);
+	gpio_set_value(lcd->pins.e, 0);
 
-	// Part 2. Set to data mode
-	gpio_set_value(LCD_RS_PIN_NUMBER, RS_DATA_MODE);
-        usleep_range(5, 10);
+	lcd_bus_record_timing( lcd, start, (lcd->timing.nibble_us + lcd->timing.pulse_us) * NSEC_PER_USEC );
 
-	// Part 2. Simulate falling edge triggered clock
-	gpio_set_value(LCD_E_PIN_NUMBER, 1);
-	usleep_range(5, 10);
-	gpio_set_value(LCD_E_PIN_NUMBER, 0);	
+	return nibble;
 }
 
 /*
- * description: 	initialize the LCD in 4 bit mode as described on the HD44780 LCD controller document.
+ * description:		read a stream of full bytes over the GPIO pins, upper 4 bits first.
+ *
+ * @param rs_mode	RS_DATA_MODE to read DDRAM/CGRAM, RS_COMMAND_MODE to read the busy flag and address
+ * @return		0 on success, or -ENODEV if the R/W line is not connected
 */
-static void lcd_initialize()
+static int lcd_gpio_read_bytes(struct klcd_device *lcd, unsigned int rs_mode, char *bytes, unsigned int count)
 {
-	usleep_range(41*1000, 50*1000);	// wait for more than 40 ms once the power is on
+	unsigned int i;
 
-	lcd_instruction(0x30);		// Instruction 0011b (Function set)
-	usleep_range(5*1000, 6*1000);	// wait for more than 4.1 ms
+	if( !lcd->rw_wired )
+		return -ENODEV;
 
-	lcd_instruction(0x30);		// Instruction 0011b (Function set)
-	usleep_range(100,200);		// wait for more than 100 us
+	gpio_direction_input(lcd->pins.db[3]);
+	gpio_direction_input(lcd->pins.db[2]);
+	gpio_direction_input(lcd->pins.db[1]);
+	gpio_direction_input(lcd->pins.db[0]);
 
-	lcd_instruction(0x30);		// Instruction 0011b (Function set)
-	usleep_range(100,200);		// wait for more than 100 us
+	gpio_set_value(lcd->pins.rs, rs_mode);
+	gpio_set_value(lcd->pins.rw, 1);
 
-	lcd_instruction(0x20);		/* Instruction 0010b (Function set)
-					   Set interface to be 4 bits long
-					*/
-	usleep_range(100,200);		// wait for more than 100 us
+	for( i = 0; i < count; i++ )
+	{
+		bytes[i]  = lcd_gpio_read_nibble( lcd ) & 0xF0;
+		bytes[i] |= (lcd_gpio_read_nibble( lcd ) >> 4) & 0x0F;
+	}
 
-	lcd_instruction(0x20);		// Instruction 0010b (Function set)
-	lcd_instruction(0x80);		/* Instruction NF**b
-					   Set N = 1, or 2-line display
-					   Set F = 0, or 5x8 dot character font
-					 */
-	usleep_range(41*1000,50*1000);
+	gpio_set_value(lcd->pins.rw, 0);
 
-					/* Display off */
-	lcd_instruction(0x00);		// Instruction 0000b
-	lcd_instruction(0x80);		// Instruction 1000b
-	usleep_range(100,200);
+	gpio_direction_output(lcd->pins.db[3], 0);
+	gpio_direction_output(lcd->pins.db[2], 0);
+	gpio_direction_output(lcd->pins.db[1], 0);
+	gpio_direction_output(lcd->pins.db[0], 0);
 
-					/* Display clear */
-	lcd_instruction(0x00);		// Instruction 0000b
-	lcd_instruction(0x10);		// Instruction 0001b
-	usleep_range(100,200);
+	return 0;
+}
 
-					/* Entry mode set */
-	lcd_instruction(0x00);		// Instruction 0000b
-	lcd_instruction(0x60);		/* Instruction 01(I/D)Sb -> 0110b
-					   Set I/D = 1, or increment or decrement DDRAM address by 1
-					   Set S = 0, or no display shift
-					*/
-	usleep_range(100,200);
+static int lcd_gpio_setup(struct klcd_device *lcd)
+{
+	return lcd_pin_setup_All( lcd );
+}
 
-	/* Initialization Completed, but set up default LCD setting here */
+static const struct klcd_transport lcd_gpio_transport =
+{
+	.name		= "gpio",
+	.setup		= lcd_gpio_setup,
+	.release	= lcd_pin_release_All,
+	.write_nibble	= lcd_gpio_write_nibble,
+	.write_bytes	= lcd_gpio_write_bytes,
+	.read_bytes	= lcd_gpio_read_bytes,
+};
 
-					/* Display On/off Control */
-	lcd_instruction(0x00);		// Instruction 0000b
-	lcd_instruction(0xF0);		/* Instruction 1DCBb  
-					   Set D= 1, or Display on
-					   Set C= 1, or Cursor on
-					   Set B= 1, or Blinking on
-					*/
-	usleep_range(100,200);
-}
 
+// ************ Emulator Transport ************************************
+
+/* An in-memory model of the HD44780 controller (struct klcd_emul, one per LCD). It decodes the same
+   nibble stream the GPIO transport puts on the wires, so the whole driver can be exercised (and timed)
+   without a panel attached. The emulated screen is shown in debugfs as "<name>/emul", e.g. "klcd/emul".
+
+   The emulator can also misbehave on purpose, to test the driver under faults (see struct klcd_emul_faults):
+	fault_delay_us		 added before every nibble
+	fault_corrupt_every	 every nth character written to DDRAM is stored corrupted, which the
+				 scrubber should find and repair
+	fault_read_error_every	 every nth read from the controller fails
+	fault_injected		 (read only) the number of faults injected so far
+   Writing 0 turns a fault off again.
+*/
 
 /*
- * description: 	print a string data on the LCD
- * 			(If the line number is 1 and the string is too long to be fit in the first line, the LCD
- * 			will continue to print the string on the second line)
- *
- * @param lineNumber	the line number of the LCD where the string is be printed. It should be either 1 or 2.
- * 			Otherwise, it is readjusted to 1.
- *
- * detail:		I implemented the code to only allow a certain number of characters to be written on the LCD.
- * 			As each character is written, the DDRAM address in the LCD controller is incrmented.
- * 			When the string is too long to be fit in the LCD, the DDRAM can be set back to 0 and the existing
- * 			data on the LCD are overwritten by the new data. This causes the LCD to be very unstable and also
- * 			lose data.		
+ * description:		advance the emulated address counter the way the HD44780 does.
+ *			DDRAM line 1 is 0x00-0x27 and line 2 is 0x40-0x67 in 2-line mode.
 */
-static void lcd_print(char * msg, unsigned int lineNumber)
+static void lcd_emul_step_address(struct klcd_device *lcd, bool increment)
 {
-	unsigned int counter = 0;
-	unsigned int lineNum = lineNumber;
-
-	if(msg == NULL){
-		printk( KERN_DEBUG "ERR: Empty data for lcd_print \n");
+	if( lcd->emul.select_cgram ){
+		lcd->emul.address = ( lcd->emul.address + (increment ? 1 : LCD_CGRAM_SIZE - 1) ) % LCD_CGRAM_SIZE;
 		return;
 	}
 
-	if( (lineNum != 1) && (lineNum != 2) ) { 
-		printk( KERN_DEBUG "ERR: Invalid line number readjusted to 1 \n");
-		lineNum = 1;
+	if( increment ){
+		if( lcd->emul.address == 0x27 )
+			lcd->emul.address = 0x40;
+		else if( lcd->emul.address == 0x67 )
+			lcd->emul.address = 0x00;
+		else
+			lcd->emul.address++;
+	}
+	else{
+		if( lcd->emul.address == 0x40 )
+			lcd->emul.address = 0x27;
+		else if( lcd->emul.address == 0x00 )
+			lcd->emul.address = 0x67;
+		else
+			lcd->emul.address--;
 	}
+}
 
-	if( lineNum == 1 )
-	{
-		lcd_setLinePosition( LCD_FIRST_LINE );
+/*
+ * description:		execute one complete 8-bit instruction or data byte on the emulated controller.
+*/
+static void lcd_emul_execute(struct klcd_device *lcd, unsigned int rs_mode, char value)
+{
+	unsigned char byte = (unsigned char) value;
 
-		while( *(msg) != '\0' )
-		{
-			if(counter >=  NUM_CHARS_PER_LINE )
-			{
-				lineNum = 2;	// continue writing on the next line if the string is too long
-				counter = 0;
-				break;		
+	if( rs_mode == RS_DATA_MODE ){
+		if( lcd->emul.select_cgram )
+			lcd->emul.cgram[lcd->emul.address] = value;
+		else{
+			if( lcd->emul.faults.corrupt_every && ++lcd->emul.faults.writes % lcd->emul.faults.corrupt_every == 0 ){
+				value ^= 0x01;
+				lcd->emul.faults.injected++;
 			}
-
-			lcd_data(*msg);
-			msg++;
-			counter++;
+			lcd->emul.ddram[lcd->emul.address] = value;
 		}
-	}
 
-	if( lineNum == 2)
-	{
-		lcd_setLinePosition( LCD_SECOND_LINE);
-		
-		while( *(msg) != '\0' )
-		{
-			if(counter >=  NUM_CHARS_PER_LINE )
-			{
-				 break;
-			}
+		lcd_emul_step_address( lcd, lcd->emul.increment );
+		return;
+	}
 
-			lcd_data(*msg);
-			msg++;
-			counter++;
-		}
+	if( byte & 0x80 ){				// Set DDRAM address
+		lcd->emul.address = byte & 0x7F;
+		lcd->emul.select_cgram = false;
+	}
+	else if( byte & 0x40 ){				// Set CGRAM address
+		lcd->emul.address = byte & 0x3F;
+		lcd->emul.select_cgram = true;
+	}
+	else if( byte & 0x20 ){				// Function set
+		lcd->emul.four_bit = !(byte & 0x10);
+	}
+	else if( byte & 0x10 ){				// Cursor or display shift
+		if( !(byte & 0x08) )
+			lcd_emul_step_address( lcd, byte & 0x04 );
+	}
+	else if( byte & 0x08 ){				// Display on/off control
+		lcd->emul.display_control = byte;
+	}
+	else if( byte & 0x04 ){				// Entry mode set
+		lcd->emul.increment = byte & 0x02;
+	}
+	else if( byte & 0x02 ){				// Return home
+		lcd->emul.address = 0;
+		lcd->emul.select_cgram = false;
+	}
+	else if( byte & 0x01 ){				// Clear display
+		memset( lcd->emul.ddram, ' ', sizeof(lcd->emul.ddram) );
+		lcd->emul.address = 0;
+		lcd->emul.select_cgram = false;
+		lcd->emul.increment = true;
 	}
 }
 
-/*
- * description: 	print a string data on the specified position of the LCD
- * 			(If the line number is 1 and the string is too long to be fit in the first line, the LCD
- * 			 will continue to print the string on the second line)
- *
- * @param lineNumber 	the line number of the LCD where the string is printed. It should be either 1 or 2.
- * 			Otherwise, it is readjusted to 1.
- *
- * @param nthCharacter  the nth character of the line where the string is printed.
- * 			It starts from 0, which indicates the beginning of the line specified.
-*/
-
-static void lcd_print_WithPosition(char * msg, unsigned int lineNumber, unsigned int nthCharacter)
+static void lcd_emul_write_nibble(struct klcd_device *lcd, unsigned int rs_mode, char nibble)
 {
-	unsigned int counter = nthCharacter;
-	unsigned int lineNum = lineNumber;
-	unsigned int nthChar = nthCharacter;
+	nibble &= 0xF0;
 
-	if( msg == NULL ){
-		printk( KERN_DEBUG "ERR: Empty data for lcd_print_WithPosition \n");
+	if( lcd->emul.faults.delay_us )
+		lcd_delay_us( lcd->emul.faults.delay_us );
+
+	if( !lcd->emul.four_bit ){			// 8 bit mode: DB3-DB0 are tied low
+		lcd_emul_execute( lcd, rs_mode, nibble );
 		return;
 	}
 
-	if( (lineNum != 1) && (lineNum != 2)  ){
-		printk( KERN_DEBUG "ERR: Invalid line number input readjusted to 1 \n");
-		lineNum = 1;
+	if( !lcd->emul.nibble_pending ){
+		lcd->emul.upper_nibble   = nibble;
+		lcd->emul.nibble_pending = true;
+		return;
 	}
 
-	if( lineNum == 1 )
+	lcd->emul.nibble_pending = false;
+	lcd_emul_execute( lcd, rs_mode, lcd->emul.upper_nibble | ((nibble >> 4) & 0x0F) );
+}
+
+static void lcd_emul_write_bytes(struct klcd_device *lcd, unsigned int rs_mode, const char *bytes, unsigned int count)
+{
+	unsigned int i;
+
+	for( i = 0; i < count; i++ )
 	{
-		lcd_setPosition( LCD_FIRST_LINE, nthChar );
-		
-		while( *(msg) != '\0' )
-		{
-			if( counter >= NUM_CHARS_PER_LINE )
-			{
-				lineNum = 2;  // continue writing on the next line if the string is too long
-				counter = 0;
-				nthChar = 0;
-				break;
-			}
-			lcd_data(*msg);
-			msg++;
-			counter++;
-		}
+		lcd_emul_write_nibble( lcd, rs_mode, bytes[i] & 0xF0 );
+		lcd_emul_write_nibble( lcd, rs_mode, bytes[i] << 4 );
 	}
+}
+
+static int lcd_emul_read_bytes(struct klcd_device *lcd, unsigned int rs_mode, char *bytes, unsigned int count)
+{
+	unsigned int i;
 
-	if( lineNum == 2)
-	{	
-		lcd_setPosition( LCD_SECOND_LINE, nthChar );
+	if( lcd->emul.faults.read_error_every && ++lcd->emul.faults.reads % lcd->emul.faults.read_error_every == 0 ){
+		lcd->emul.faults.injected++;
+		return -EIO;				// as if the R/W line had picked up noise
+	}
 
-		while( *(msg) != '\0' )
-		{
-			if( counter >= NUM_CHARS_PER_LINE )
-			{
-				break;
-			}	
-			lcd_data(*msg);
-			msg++;
-			counter++;
+	for( i = 0; i < count; i++ )
+	{
+		if( rs_mode == RS_COMMAND_MODE ){		// busy flag (never busy) and address counter
+			bytes[i] = lcd->emul.address & 0x7F;
+			continue;
 		}
+
+		bytes[i] = lcd->emul.select_cgram ? lcd->emul.cgram[lcd->emul.address] : lcd->emul.ddram[lcd->emul.address];
+		lcd_emul_step_address( lcd, lcd->emul.increment );
 	}
+
+	return 0;
 }
 
-/*
- * description:	set the cursor to the beginning of the line specified.
- * @param line  line number should be either 1 or 2.	
-*/
-void lcd_setLinePosition(unsigned int line)
+static int lcd_emul_show(struct seq_file *s, void *unused)
 {
-	if(line == 1){
-		lcd_instruction(0x80);	// set position to LCD line 1
-		lcd_instruction(0x00);
-	}
-	else if(line == 2){
-		lcd_instruction(0xC0);
-		lcd_instruction(0x00);
+	struct klcd_device *lcd = s->private;
+	unsigned int row;
+	unsigned int i;
+
+	for( row = 0; row < lcd->rows; row++ )
+	{
+		seq_puts( s, "|" );
+		for( i = 0; i < lcd->columns; i++ )
+			seq_putc( s, lcd->emul.ddram[ lcd_cell_address( lcd, row * lcd->columns + i ) ] );
+		seq_puts( s, "|\n" );
 	}
-	else{
-		printk("ERR: Invalid line number. Select either 1 or 2 \n");
+
+	seq_printf( s, "address: 0x%02x (%s)\n", lcd->emul.address, lcd->emul.select_cgram ? "CGRAM" : "DDRAM" );
+	seq_printf( s, "display control: 0x%02x\n", (unsigned char) lcd->emul.display_control );
+	return 0;
+}
+
+static int lcd_emul_debugfs_open(struct inode *p_inode, struct file *p_file)
+{
+	return single_open( p_file, lcd_emul_show, p_inode->i_private );
+}
+
+static const struct file_operations lcd_emul_debugfs_fops =
+{
+	.owner   = THIS_MODULE,
+	.open    = lcd_emul_debugfs_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+static int lcd_emul_setup(struct klcd_device *lcd)
+{
+	memset( lcd->emul.ddram, ' ', sizeof(lcd->emul.ddram) );
+	memset( lcd->emul.cgram, 0, sizeof(lcd->emul.cgram) );
+
+	lcd->emul.address        = 0;
+	lcd->emul.select_cgram   = false;
+	lcd->emul.increment      = true;
+	lcd->emul.four_bit       = false;	// the controller powers up in 8 bit mode
+	lcd->emul.nibble_pending = false;
+
+	memset( &lcd->emul.faults, 0, sizeof(lcd->emul.faults) );
+
+	lcd->emul.debugfs_dir = debugfs_create_dir( lcd->name, NULL );
+	if( !IS_ERR_OR_NULL(lcd->emul.debugfs_dir) )
+	{
+		debugfs_create_file( "emul", S_IRUGO, lcd->emul.debugfs_dir, lcd, &lcd_emul_debugfs_fops );
+		debugfs_create_u32( "fault_delay_us",         S_IRUGO | S_IWUSR, lcd->emul.debugfs_dir, &lcd->emul.faults.delay_us );
+		debugfs_create_u32( "fault_corrupt_every",    S_IRUGO | S_IWUSR, lcd->emul.debugfs_dir, &lcd->emul.faults.corrupt_every );
+		debugfs_create_u32( "fault_read_error_every", S_IRUGO | S_IWUSR, lcd->emul.debugfs_dir, &lcd->emul.faults.read_error_every );
+		debugfs_create_u32( "fault_injected",         S_IRUGO,           lcd->emul.debugfs_dir, &lcd->emul.faults.injected );
 	}
+
+	return 0;
+}
+
+static void lcd_emul_release(struct klcd_device *lcd)
+{
+	debugfs_remove_recursive( lcd->emul.debugfs_dir );
 }
 
+static const struct klcd_transport lcd_emul_transport =
+{
+	.name		= "emul",
+	.setup		= lcd_emul_setup,
+	.release	= lcd_emul_release,
+	.write_nibble	= lcd_emul_write_nibble,
+	.write_bytes	= lcd_emul_write_bytes,
+	.read_bytes	= lcd_emul_read_bytes,
+};
+
+
+// ************ Transport Selection ***********************************
+
+static const struct klcd_transport *lcd_transports[] = {
+	&lcd_gpio_transport,
+	&lcd_emul_transport,
+};
+
+static char *transport = "gpio";
+module_param( transport, charp, S_IRUGO );
+MODULE_PARM_DESC( transport, "bus transport to reach the LCD controller: gpio (default) or emul, unless the device tree sets klcd,transport" );
+
 /*
- * description:  	 set the cursor to the nth character of the line specified.
- * @param line 		 the line number should be either 1 or 2. 
- * @param nthCharacter	 n'th character where the cursor should start on the line specified.
- * 			 It starts from 0, which indicates the beginning of the line.
+ * description:		look up a transport by name.
+ *
+ * @param name		the "transport" module parameter or the "klcd,transport" property
+ * @return		the transport, or NULL if there is no such transport
 */
-void lcd_setPosition(unsigned int line, unsigned int nthCharacter)
+static const struct klcd_transport *lcd_transport_select(const char *name)
 {
-	char command;
+	unsigned int i;
 
-	if(line == 1){
-		command = 0x80 + (char) nthCharacter;
-		
-		lcd_instruction(  command & 0xF0 ); 	  // upper 4 bits of command
-		lcd_instruction( (command & 0x0F) << 4 ); // lower 4 bits of command 
+	for( i = 0; i < ARRAY_SIZE(lcd_transports); i++ )
+	{
+		if( strcmp( lcd_transports[i]->name, name ) == 0 )
+			return lcd_transports[i];
 	}
-	else if(line == 2){
-		command = 0xC0 + (char) nthCharacter;
 
-		lcd_instruction(  command & 0xF0 ); 	  // upper 4 bits of command
-		lcd_instruction( (command & 0x0F) << 4 ); // lower 4 bits of command
-	}
-	else{
-		printk("ERR: Invalid line number. Select either 1 or 2 \n");
-	}	
+	return NULL;
 }
 
+// ************ Shadow Buffer *****************************************
+
+/* The driver cannot read the panel back, so it keeps a copy of every visible cell (what is on the glass)
+   and of the controller's address counter. Both are updated by lcd_command() and lcd_data_bulk() as the
+   bytes go out, which lets lcd_update_cells() send only the cells that actually change. The buffers
+   are in struct klcd_device, one set per LCD, and lcd->mutex serializes the users of both. Readers that
+   are not on the bus (read(), the sysfs attributes, the CGRAM allocator) copy the cells under
+   lcd->shadow_lock instead, a seqlock, so they never wait for a transfer to finish.
+
+   Cells are numbered line by line, (line - 1) * lcd->columns + nthCharacter. The controller always runs
+   in 2-line mode; on a 4-line LCD lines 3 and 4 continue lines 1 and 2 in DDRAM.
+*/
+
 /*
- * description:	clear the display on the LCD	
+ * description:		DDRAM address of the first cell of a line.
+ * @param row		the line, starting from 0
 */
-static void lcd_clearDisplay()
+static unsigned int lcd_row_address(struct klcd_device *lcd, unsigned int row)
 {
-	lcd_instruction( 0x00 ); // upper 4 bits of command
-	lcd_instruction( 0x10 ); // lower 4 bits of command
-
-	printk(KERN_INFO "klcd Driver: display clear\n");
+	return ( (row % 2) ? LCD_SECOND_LINE_ADDRESS : LCD_FIRST_LINE_ADDRESS ) + (row / 2) * lcd->columns;
 }
 
 /*
- * description:	show a blinking cursor on the LCD screen	
+ * description:		DDRAM address of a cell.
+ * @param cell		linear cell index, (line - 1) * lcd->columns + nthCharacter
 */
-static void lcd_cursor_on()
+static unsigned int lcd_cell_address(struct klcd_device *lcd, unsigned int cell)
 {
-					/* Display On/off Control */
-	lcd_instruction(0x00);		// Instruction 0000b
-	lcd_instruction(0xF0);		/* Instruction 1DCBb  
-					   Set D= 1, or Display on
-
-					   Set C= 1, or Cursor on
-					   Set B= 1, or Blinking on
-					*/
-	printk(KERN_INFO "klcd Driver: lcd_cursor_on\n");
+	return lcd_row_address( lcd, cell / lcd->columns ) + (cell % lcd->columns);
 }
 
 /*
- * description:	hide a blinking cursor from the LCD screen	
+ * description:		position of a DDRAM address on the ring that the address counter walks in 2-line mode
+ *			(0x00-0x27, then 0x40-0x67, then back to 0x00).
+ * @return		0 to LCD_DDRAM_RING - 1, or -1 if the address is not used in 2-line mode
 */
-static void lcd_cursor_off()
+static int lcd_address_ring(unsigned int address)
 {
-					/* Display On/off Control */
-	lcd_instruction(0x00);		// Instruction 0000b
-	lcd_instruction(0xC0);		/* Instruction 1DCBb  
-					   Set D= 1, or Display on
+	if( address >= LCD_FIRST_LINE_ADDRESS && address < LCD_FIRST_LINE_ADDRESS + LCD_DDRAM_LINE_LENGTH )
+		return address - LCD_FIRST_LINE_ADDRESS;
+	if( address >= LCD_SECOND_LINE_ADDRESS && address < LCD_SECOND_LINE_ADDRESS + LCD_DDRAM_LINE_LENGTH )
+		return LCD_DDRAM_LINE_LENGTH + address - LCD_SECOND_LINE_ADDRESS;
 
-					   Set C= 0, or Cursor off
-					   Set B= 0, or Blinking off
-					*/
-	printk(KERN_INFO "klcd Driver: lcd_cursor_off\n");
+	return -1;
 }
 
+/*
+ * description:		cell shown at a DDRAM address.
+ * @return		linear cell index, or -1 if the address is not visible
+*/
+static int lcd_address_cell(struct klcd_device *lcd, unsigned int address)
+{
+	unsigned int row;
+	unsigned int first;
+
+	for( row = 0; row < lcd->rows; row++ )
+	{
+		first = lcd_row_address( lcd, row );
+		if( address >= first && address < first + lcd->columns )
+			return row * lcd->columns + address - first;
+	}
 
+	return -1;
+}
 
 /*
- * description:	turn off the LCD display. It is called upon module exit	
+ * description:		move the address counter by one, the way the HD44780 does after a data byte or a cursor shift.
+ *			DDRAM line 1 is 0x00-0x27 and line 2 is 0x40-0x67 in 2-line mode.
+ * @param increment	move right (true) or left (false)
 */
-static void lcd_display_off(void)
+static void lcd_address_step(struct klcd_device *lcd, bool increment)
 {
-	lcd_instruction(0x00);		// Instruction 0000b
-	lcd_instruction(0x80);		/* Instruction 1DCBb  
-					   Set D= 0, or Display off
+	int position;
 
-					   Set C= 0, or Cursor off
-					   Set B= 0, or Blinking off
-					*/
-	printk(KERN_INFO "klcd Driver: lcd_display_off\n");
-}
+	if( lcd->address_cgram ){
+		lcd->address = ( lcd->address + (increment ? 1 : LCD_CGRAM_SIZE - 1) ) % LCD_CGRAM_SIZE;
+		return;
+	}
 
+	position = lcd_address_ring( lcd->address );
+	if( position < 0 )
+		return;
 
-// ************* File Operations *****************************************************************
+	position = ( position + (increment ? 1 : LCD_DDRAM_RING - 1) ) % LCD_DDRAM_RING;
+	lcd->address = (position < LCD_DDRAM_LINE_LENGTH) ? LCD_FIRST_LINE_ADDRESS + position
+							  : LCD_SECOND_LINE_ADDRESS + position - LCD_DDRAM_LINE_LENGTH;
+}
 
-static int klcd_open(struct inode *p_inode, struct file *p_file )
+/*
+ * description:		follow the effect of a command on the address counter and the screen.
+*/
+static void lcd_shadow_command(struct klcd_device *lcd, unsigned char command)
 {
-	printk(KERN_INFO "klcd Driver: open()\n");
-	return 0;
+	if( command & 0x80 ){				// Set DDRAM address
+		lcd->address = command & 0x7F;
+		lcd->address_cgram = false;
+	}
+	else if( command & 0x40 ){			// Set CGRAM address
+		lcd->address = command & 0x3F;
+		lcd->address_cgram = true;
+	}
+	else if( (command & 0xFE) == 0x02 ){		// Return home
+		lcd->address = 0;
+		lcd->address_cgram = false;
+	}
+	else if( (command & 0xF8) == 0x10 ){		// Cursor shift (moves the address counter)
+		lcd_address_step( lcd, command & 0x04 );
+	}
+	else if( command == 0x01 ){			// Clear display
+		write_seqlock( &lcd->shadow_lock );
+		memset( lcd->shadow, ' ', sizeof(lcd->shadow) );
+		bitmap_zero( lcd->shadow_unknown, lcd->cells );
+		write_sequnlock( &lcd->shadow_lock );
+		lcd->address = 0;
+		lcd->address_cgram = false;
+	}
 }
-static int klcd_close(struct inode *p_inode, struct file *p_file )
+
+/*
+ * description:		follow a data write on the address counter and the screen (increment mode only).
+ * @param data		the data written, or NULL for a data read, which only moves the address counter
+*/
+static void lcd_shadow_data(struct klcd_device *lcd, const char * data, unsigned int count)
+{
+	unsigned int i;
+	int cell;
+
+	write_seqlock( &lcd->shadow_lock );
+
+	for( i = 0; i < count; i++ )
+	{
+		if( lcd->address_cgram ){
+			if( data != NULL )
+				lcd->cgram_shadow[lcd->address % LCD_CGRAM_SIZE] = data[i];
+			lcd_address_step( lcd, true );
+			continue;
+		}
+
+		cell = lcd_address_cell( lcd, lcd->address );
+		if( cell >= 0 && data != NULL ){
+			lcd->shadow[cell] = data[i];
+			clear_bit( cell, lcd->shadow_unknown );
+		}
+
+		lcd_address_step( lcd, true );
+	}
+
+	write_sequnlock( &lcd->shadow_lock );
+}
+
+/*
+ * description:		copy cells of the shadow buffer without taking lcd->mutex, so the caller does not wait
+ *			for the bus. The copy is consistent: a data transfer is either all in it or not at all.
+*/
+static void lcd_shadow_copy(struct klcd_device *lcd, unsigned int cell, char *buf, unsigned int count)
+{
+	unsigned int seq;
+
+	do{
+		seq = read_seqbegin( &lcd->shadow_lock );
+		memcpy( buf, lcd->shadow + cell, count );
+	} while( read_seqretry( &lcd->shadow_lock, seq ) );
+}
+
+/*
+ * description:		send a 4-bit command to the HD44780 LCD controller.
+ *
+ * @param command	 command to be sent to the LCD controller. Only the upper 4 bits of this command is used.
+*/
+static void lcd_instruction(struct klcd_device *lcd, char command)
+{
+	lcd->transport->write_nibble( lcd, RS_COMMAND_MODE, command );
+}
+
+/*
+ * description:		send a full 8-bit command to the HD44780 LCD controller (upper 4 bits first).
+ *
+ * @param command	command to be sent to the LCD controller.
+*/
+static void lcd_command(struct klcd_device *lcd, char command)
+{
+	lcd->transport->write_bytes( lcd, RS_COMMAND_MODE, &command, 1 );
+	lcd_shadow_command( lcd, (unsigned char) command );
+
+	// clear and home take much longer than other instructions, which a calibrated nibble_us may not cover
+	if( (unsigned char) command <= 0x03 && lcd->timing.nibble_us < LCD_CLEAR_US )
+		lcd_delay_us( LCD_CLEAR_US - lcd->timing.nibble_us );
+}
+
+/*
+ * description:		send a 1-byte ASCII character data to the HD44780 LCD controller.
+ * @param data		a 1-byte data to be sent to the LCD controller. Both the upper 4 bits and the lower 4 bits are used.
+*/
+static void lcd_data(struct klcd_device *lcd, char data)
+{
+	lcd_data_bulk( lcd, &data, 1 );
+}
+
+/*
+ * description:		send a run of character data to the HD44780 LCD controller in one transport call.
+ *
+ * @param data		data to be written from the current DDRAM or CGRAM address onwards
+ * @param count		the number of bytes
+*/
+static void lcd_data_bulk(struct klcd_device *lcd, const char * data, unsigned int count)
+{
+	if( count == 0 )
+		return;
+
+	lcd->transport->write_bytes( lcd, RS_DATA_MODE, data, count );
+	lcd_shadow_data( lcd, data, count );
+}
+
+/*
+ * description:		read the character codes of a run of cells back from DDRAM.
+ *
+ * @param cell		linear cell index of the first character
+ * @param data		buffer for the character codes
+ * @param count		the number of cells. The run must not cross the end of a line.
+ *
+ * @return		0 on success, or -ENODEV if the transport cannot read from the LCD
+*/
+static int lcd_read_cells(struct klcd_device *lcd, unsigned int cell, char * data, unsigned int count)
+{
+	int ret;
+
+	if( lcd->transport->read_bytes == NULL )
+		return -ENODEV;
+
+	lcd_plan_seek( lcd, cell );
+
+	ret = lcd->transport->read_bytes( lcd, RS_DATA_MODE, data, count );
+	if( ret == 0 )
+		lcd_shadow_data( lcd, NULL, count );
+
+	return ret;
+}
+
+/*
+ * description: 	initialize the LCD in 4 bit mode as described on the HD44780 LCD controller document.
+*/
+static void lcd_initialize(struct klcd_device *lcd)
+{
+	usleep_range(41*1000, 50*1000);	// wait for more than 40 ms once the power is on
+
+	lcd_instruction(lcd, 0x30);		// Instruction 0011b (Function set)
+	usleep_range(5*1000, 6*1000);	// wait for more than 4.1 ms
+
+	lcd_instruction(lcd, 0x30);		// Instruction 0011b (Function set)
+	usleep_range(100,200);		// wait for more than 100 us
+
+	lcd_instruction(lcd, 0x30);		// Instruction 0011b (Function set)
+	usleep_range(100,200);		// wait for more than 100 us
+
+	lcd_instruction(lcd, 0x20);		/* Instruction 0010b (Function set)
+					   Set interface to be 4 bits long
+					*/
+	usleep_range(100,200);		// wait for more than 100 us
+
+	lcd_instruction(lcd, 0x20);		// Instruction 0010b (Function set)
+	lcd_instruction(lcd, 0x80);		/* Instruction NF**b
+					   Set N = 1, or 2-line display
+					   Set F = 0, or 5x8 dot character font
+					 */
+	usleep_range(41*1000,50*1000);
+
+					/* Display off */
+	lcd_instruction(lcd, 0x00);		// Instruction 0000b
+	lcd_instruction(lcd, 0x80);		// Instruction 1000b
+	usleep_range(100,200);
+
+					/* Display clear */
+	lcd_instruction(lcd, 0x00);		// Instruction 0000b
+	lcd_instruction(lcd, 0x10);		// Instruction 0001b
+	usleep_range(100,200);
+
+					/* Entry mode set */
+	lcd_instruction(lcd, 0x00);		// Instruction 0000b
+	lcd_instruction(lcd, 0x60);		/* Instruction 01(I/D)Sb -> 0110b
+					   Set I/D = 1, or increment or decrement DDRAM address by 1
+					   Set S = 0, or no display shift
+					*/
+	usleep_range(100,200);
+
+	/* Initialization Completed, but set up default LCD setting here */
+
+					/* Display On/off Control */
+	lcd_instruction(lcd, 0x00);		// Instruction 0000b
+	lcd_instruction(lcd, 0xF0);		/* Instruction 1DCBb  
+					   Set D= 1, or Display on
+					   Set C= 1, or Cursor on
+					   Set B= 1, or Blinking on
+					*/
+	usleep_range(100,200);
+
+	write_seqlock( &lcd->shadow_lock );
+	memset( lcd->shadow, ' ', sizeof(lcd->shadow) );	// the display has been cleared above
+	bitmap_zero( lcd->shadow_unknown, lcd->cells );
+	write_sequnlock( &lcd->shadow_lock );
+	lcd->address        = 0;
+	lcd->address_cgram  = false;
+	lcd->cursor_visible = true;
+}
+
+
+/*
+ * description: 	print a string data on the LCD
+ * 			(If the line number is 1 and the string is too long to be fit in the first line, the LCD
+ * 			will continue to print the string on the second line)
+ *
+ * @param lineNumber	the line number of the LCD where the string is be printed. It should be either 1 or 2.
+ * 			Otherwise, it is readjusted to 1.
+ * @param priority	update queue lane, KLCD_PRIORITY_NORMAL or KLCD_PRIORITY_ALERT
+ *
+ * detail:		I implemented the code to only allow a certain number of characters to be written on the LCD.
+ * 			As each character is written, the DDRAM address in the LCD controller is incrmented.
+ * 			When the string is too long to be fit in the LCD, the DDRAM can be set back to 0 and the existing
+ * 			data on the LCD are overwritten by the new data. This causes the LCD to be very unstable and also
+ * 			lose data.		
+*/
+static void lcd_print(struct klcd_device *lcd, char * msg, unsigned int lineNumber, unsigned int priority)
+{
+	if(msg == NULL){
+		printk( KERN_DEBUG "ERR: Empty data for lcd_print \n");
+		return;
+	}
+
+	lcd_print_WithPosition( lcd, msg, lineNumber, 0, priority );
+}
+
+/*
+ * description: 	print a string data on the specified position of the LCD
+ * 			(If the line number is 1 and the string is too long to be fit in the first line, the LCD
+ * 			 will continue to print the string on the second line)
+ *
+ * @param lineNumber 	the line number of the LCD where the string is printed. It should be from 1 to lcd->rows.
+ * 			Otherwise, it is readjusted to 1.
+ *
+ * @param nthCharacter  the nth character of the line where the string is printed.
+ * 			It starts from 0, which indicates the beginning of the line specified.
+ *
+ * @param priority	update queue lane, KLCD_PRIORITY_NORMAL or KLCD_PRIORITY_ALERT
+*/
+
+static void lcd_print_WithPosition(struct klcd_device *lcd, char * msg, unsigned int lineNumber, unsigned int nthCharacter, unsigned int priority)
+{
+	unsigned int lineNum = lineNumber;
+	unsigned int nthChar = MIN( nthCharacter, lcd->columns );
+	unsigned int first;
+
+	if( msg == NULL ){
+		printk( KERN_DEBUG "ERR: Empty data for lcd_print_WithPosition \n");
+		return;
+	}
+
+	if( (lineNum < 1) || (lineNum > lcd->rows)  ){
+		printk( KERN_DEBUG "ERR: Invalid line number input readjusted to 1 \n");
+		lineNum = 1;
+	}
+
+	/* Cells are numbered line by line, so a string that starts on one line continues on the next
+	   line simply by running past the end of the first one. A string on the last line stops
+	   at the end of the screen.
+	*/
+	first = (lineNum - 1) * lcd->columns + nthChar;
+
+	lcd_queue_text( lcd, first, msg, strnlen( msg, lcd->cells - first ), priority );
+}
+
+/*
+ * description:  	 set the cursor to the nth character of the line specified.
+ * @param line 		 the line number should be from 1 to lcd->rows.
+ * @param nthCharacter	 n'th character where the cursor should start on the line specified.
+ * 			 It starts from 0, which indicates the beginning of the line.
+*/
+void lcd_setPosition(struct klcd_device *lcd, unsigned int line, unsigned int nthCharacter)
+{
+	char command;
+
+	if( line >= 1 && line <= lcd->rows ){
+		command = 0x80 | ( lcd_row_address( lcd, line - 1 ) + (char) nthCharacter );
+		lcd_command( lcd, command );
+	}
+	else{
+		printk("ERR: Invalid line number. Select from 1 to %u \n", lcd->rows);
+	}	
+}
+
+/* Moving the address counter to the next cell to be written can be done in several ways: nothing at all
+   when auto-increment already got there, a Set DDRAM Address, Return Home, or rewriting the unchanged
+   cells in between with what they already show. The planner prices each option with the cost of its
+   instructions on the bus (lcd_plan_costs()) and takes the cheapest. Cursor Shift is not among them:
+   it moves by one cell for the price of an instruction, and one Set DDRAM Address goes anywhere.
+*/
+
+
+static const char * const lcd_plan_names[KLCD_MOVE_COUNT] = {
+	[KLCD_MOVE_NONE]	= "auto",
+	[KLCD_MOVE_SET]		= "set",
+	[KLCD_MOVE_REWRITE]	= "rewrite",
+	[KLCD_MOVE_HOME]	= "home",
+};
+
+/*
+ * description:		cost of each instruction in us, from the bus timing in use.
+ *
+ * detail:		Over GPIO every byte is two nibbles, so an instruction and a data byte cost the same;
+ *			clear and home are slower to execute.
+*/
+static void lcd_plan_costs(struct klcd_device *lcd, struct klcd_costs *costs)
+{
+	unsigned int byte = 2 * (lcd->timing.nibble_us + 2 * lcd->timing.pulse_us);
+
+	costs->command = byte;
+	costs->data    = byte;
+	costs->home    = byte + ( (lcd->timing.nibble_us < LCD_CLEAR_US) ? LCD_CLEAR_US - lcd->timing.nibble_us : 0 );
+}
+
+/*
+ * description:		check whether the cells from one cell up to (not including) another can be rewritten with their
+ *			shadow contents on the way, i.e. they are on one line and none of them is unknown.
+*/
+static bool lcd_plan_rewritable(struct klcd_device *lcd, unsigned int from, unsigned int cell)
+{
+	unsigned int i;
+
+	if( from > cell || from / lcd->columns != cell / lcd->columns )
+		return false;
+
+	for( i = from; i < cell; i++ )
+	{
+		if( test_bit( i, lcd->shadow_unknown ) )
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * description:		move the address counter to a cell in the cheapest way.
+ *
+ * @param cell		the cell to be written (or read) next
+ * @return		the number of cells before it that the caller must rewrite from the shadow buffer first
+*/
+static unsigned int lcd_plan_move(struct klcd_device *lcd, unsigned int cell)
+{
+	unsigned int target = lcd_cell_address( lcd, cell );
+	enum klcd_move move = KLCD_MOVE_SET;
+	struct klcd_costs costs;
+	unsigned int steps = 0;
+	unsigned int best;
+	unsigned int cost;
+	int here;
+
+	if( !lcd->address_cgram && lcd->address == target ){
+		lcd->plan_stats[KLCD_MOVE_NONE]++;
+		return 0;
+	}
+
+	lcd_plan_costs( lcd, &costs );
+	best = costs.command;				// Set DDRAM Address
+
+	here = lcd->address_cgram ? -1 : lcd_address_cell( lcd, lcd->address );
+	if( here >= 0 && lcd_plan_rewritable( lcd, here, cell ) )
+	{
+		cost = (cell - here) * costs.data;
+		if( cost <= best ){			// on a tie rewriting also refreshes the cells
+			best  = cost;
+			move  = KLCD_MOVE_REWRITE;
+			steps = cell - here;
+		}
+	}
+
+	if( lcd_plan_rewritable( lcd, 0, cell ) )		// Return Home, then rewrite up to the cell
+	{
+		cost = costs.home + cell * costs.data;
+		if( cost < best ){
+			best  = cost;
+			move  = KLCD_MOVE_HOME;
+			steps = cell;
+		}
+	}
+
+	lcd->plan_stats[move]++;
+
+	switch( move ){
+		case KLCD_MOVE_HOME:
+			lcd_command( lcd, 0x02 );		// Instruction 0000 0010b (Return home)
+			return steps;
+
+		case KLCD_MOVE_REWRITE:
+			return steps;
+
+		default:
+			lcd_setPosition( lcd, cell / lcd->columns + 1, cell % lcd->columns );
+			return 0;
+	}
+}
+
+/*
+ * description:		put the address counter on a cell, rewriting unchanged cells on the way if the planner chose to.
+*/
+static void lcd_plan_seek(struct klcd_device *lcd, unsigned int cell)
+{
+	unsigned int gap = lcd_plan_move( lcd, cell );
+
+	lcd_data_bulk( lcd, lcd->shadow + cell - gap, gap );
+}
+
+/*
+ * description:		check whether a cell has to be written to show a character code.
+*/
+static bool lcd_cell_differs(struct klcd_device *lcd, unsigned int cell, char code)
+{
+	return lcd->shadow[cell] != code || test_bit( cell, lcd->shadow_unknown );
+}
+
+/*
+ * description:		update a range of cells, sending only those that differ from the shadow buffer.
+ *
+ * @param cell		linear cell index of the first character, (line - 1) * lcd->columns + nthCharacter
+ * @param text		character codes (already translated) for the cells
+ * @param count		the number of cells. It is cut to the end of the screen.
+*/
+static void lcd_update_cells(struct klcd_device *lcd, unsigned int cell, const char * text, unsigned int count)
+{
+	unsigned int end;
+	unsigned int run;
+
+	lcd_cgram_sync( lcd );		// new glyph bitmaps go out before the cells that show them
+
+	if( cell >= lcd->cells )
+		return;
+	count = MIN( count, lcd->cells - cell );
+	end   = cell + count;
+
+	while( cell < end )
+	{
+		if( !lcd_cell_differs( lcd, cell, *text ) ){
+			cell++;
+			text++;
+			continue;
+		}
+
+		// a run of changed cells, which must not cross the end of a line
+		run = 1;
+		while( cell + run < end && (cell + run) % lcd->columns != 0 && lcd_cell_differs( lcd, cell + run, text[run] ) )
+			run++;
+
+		lcd_plan_seek( lcd, cell );
+		lcd_data_bulk( lcd, text, run );
+		cell += run;
+		text += run;
+	}
+}
+
+/*
+ * description:	clear the display on the LCD	
+*/
+static void lcd_clearDisplay(struct klcd_device *lcd)
+{
+	lcd_command( lcd, 0x01 );	// Instruction 0000 0001b (Clear display)
+
+	mutex_lock( &lcd->cgram_lock );
+	lcd_cgram_reset( lcd );	// nothing on the screen uses the CGRAM glyphs any more
+	mutex_unlock( &lcd->cgram_lock );
+
+	printk(KERN_INFO "klcd Driver: display clear\n");
+}
+
+/*
+ * description:	show a blinking cursor on the LCD screen	
+*/
+static void lcd_cursor_on(struct klcd_device *lcd)
+{
+					/* Display On/off Control */
+	lcd->cursor_visible = true;
+	lcd_command(lcd, 0x0F);		/* Instruction 0000 1DCBb
+					   Set D= 1, or Display on
+
+					   Set C= 1, or Cursor on
+					   Set B= 1, or Blinking on
+					*/
+	printk(KERN_INFO "klcd Driver: lcd_cursor_on\n");
+}
+
+/*
+ * description:	hide a blinking cursor from the LCD screen	
+*/
+static void lcd_cursor_off(struct klcd_device *lcd)
+{
+					/* Display On/off Control */
+	lcd->cursor_visible = false;
+	lcd_command(lcd, 0x0C);		/* Instruction 0000 1DCBb
+					   Set D= 1, or Display on
+
+					   Set C= 0, or Cursor off
+					   Set B= 0, or Blinking off
+					*/
+	printk(KERN_INFO "klcd Driver: lcd_cursor_off\n");
+}
+
+
+
+/*
+ * description:	turn off the LCD display. It is called upon module exit	
+*/
+static void lcd_display_off(struct klcd_device *lcd)
+{
+	lcd_command(lcd, 0x08);		/* Instruction 0000 1DCBb
+					   Set D= 0, or Display off
+
+					   Set C= 0, or Cursor off
+					   Set B= 0, or Blinking off
+					*/
+	printk(KERN_INFO "klcd Driver: lcd_display_off\n");
+}
+
+
+
+// ************* Update Queue ********************************************************************
+
+/* Every change to the display is queued as a struct klcd_update in one of LCD_NUM_PRIORITIES lanes and
+   applied by a single bus thread, the only user of the bus apart from probe, remove and a state restore.
+
+   Submitting takes no lock: the update is pushed onto the lock-less inbox (an llist) of its priority,
+   so any number of writers can submit at the same time without waiting for each other or for the bus.
+   The bus thread is the only consumer. It takes whole inboxes at once and appends them, oldest first, to
+   lanes that only it touches. Text and commands are submitted asynchronously: the submitter returns as
+   soon as its update is in the inbox and the bus thread frees it once applied. Only when an LCD already
+   holds LCD_QUEUE_MAX_ASYNC updates does the submitter wait for its own, which keeps a writer that is
+   faster than the panel from using up memory. fsync() and the sysfs attributes wait for everything
+   submitted before them with a barrier (lcd_queue_flush()).
+
+   The thread
+   can run with a SCHED_FIFO priority and be bound to one CPU (bus_priority and bus_cpu), so the timing on
+   the bus does not depend on the scheduling of whichever process made the update. The thread
+   always serves the highest non-empty lane. Updates in lower lanes are applied one line at a time, and
+   as soon as higher priority work arrives the update is left at the head of its lane with its progress
+   recorded in ->done. When it is resumed, it skips the cells that an update submitted after it has
+   written in the meantime, so an alert is not overwritten by older text that it happened to preempt.
+*/
+
+static int bus_priority;
+module_param( bus_priority, int, S_IRUGO );
+MODULE_PARM_DESC( bus_priority, "SCHED_FIFO priority (1-99) of the bus thread, 0 for a normal thread. From Linux 5.9 on "
+		  "any value above 0 gives the kernel's default SCHED_FIFO priority (50)" );
+
+static int bus_cpu = -1;
+module_param( bus_cpu, int, S_IRUGO );
+MODULE_PARM_DESC( bus_cpu, "CPU the bus thread is bound to, -1 (default) for any CPU" );
+
+static unsigned int deadline_ms[LCD_NUM_PRIORITIES] = { 500, 50 };
+module_param_array( deadline_ms, uint, NULL, S_IRUGO );
+MODULE_PARM_DESC( deadline_ms, "time in ms from submission to display within which an update should be shown, per priority (normal,alert)" );
+
+
+/*
+ * description:		move the updates submitted at one priority from its inbox to the end of its lane. Bus thread only.
+ * @return		true if the lane is not empty
+*/
+static bool lcd_queue_collect(struct klcd_device *lcd, unsigned int priority)
+{
+	struct list_head *tail = lcd->lanes[priority].prev;
+	struct llist_node *node = llist_del_all( &lcd->inbox[priority] );
+	struct klcd_update *update;
+
+	// the inbox is newest first, so each update goes in front of the one submitted after it
+	while( node != NULL )
+	{
+		update = llist_entry( node, struct klcd_update, node );
+		node   = node->next;
+
+		list_add( &update->list, tail );
+	}
+
+	return !list_empty( &lcd->lanes[priority] );
+}
+
+/*
+ * description:		the update the worker should apply next. Bus thread only.
+ * @return		the head of the highest non-empty lane, or NULL if the queue is empty
+*/
+static struct klcd_update *lcd_queue_peek(struct klcd_device *lcd)
+{
+	int priority;
+
+	for( priority = LCD_NUM_PRIORITIES - 1; priority >= 0; priority-- )
+	{
+		if( lcd_queue_collect( lcd, priority ) )
+			return list_first_entry( &lcd->lanes[priority], struct klcd_update, list );
+	}
+
+	return NULL;
+}
+
+/*
+ * description:		check whether work of a higher priority is waiting.
+*/
+static bool lcd_queue_preempted(struct klcd_device *lcd, unsigned int priority)
+{
+	unsigned int i;
+
+	for( i = priority + 1; i < LCD_NUM_PRIORITIES; i++ )
+	{
+		if( !llist_empty( &lcd->inbox[i] ) || !list_empty( &lcd->lanes[i] ) )
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * description:		check whether anything has been submitted that the bus thread has not applied yet.
+*/
+static bool lcd_queue_pending(struct klcd_device *lcd)
+{
+	unsigned int i;
+
+	for( i = 0; i < LCD_NUM_PRIORITIES; i++ )
+	{
+		if( !llist_empty( &lcd->inbox[i] ) || !list_empty( &lcd->lanes[i] ) )
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * description:		hand an applied update back: free it if it is async, otherwise wake its submitter.
+*/
+static void lcd_queue_retire(struct klcd_device *lcd, struct klcd_update *update)
+{
+	if( update->async ){
+		kfree( update );
+		atomic_dec( &lcd->queued_async );
+	}
+	else
+		complete( &update->completion );
+}
+
+/*
+ * description:		check whether a cell has been written by an update submitted after the given one.
+*/
+static bool lcd_cell_superseded(struct klcd_device *lcd, unsigned int cell, const struct klcd_update *update)
+{
+	return (s32) (lcd->cell_seq[cell] - update->seq) > 0;
+}
+
+/*
+ * description:		apply the cells of a text update from ->done up to end, leaving out superseded cells.
+*/
+static void lcd_apply_cells(struct klcd_device *lcd, struct klcd_update *update, unsigned int end)
+{
+	unsigned int first = update->cell;
+	unsigned int run;
+
+	mutex_lock( &lcd->mutex );
+
+	while( update->done < end )
+	{
+		if( lcd_cell_superseded( lcd, first + update->done, update ) ){
+			update->done++;
+			continue;
+		}
+
+		run = 1;
+		while( update->done + run < end && !lcd_cell_superseded( lcd, first + update->done + run, update ) )
+			run++;
+
+		lcd_update_cells( lcd, first + update->done, update->text + update->done, run );
+		for( ; run > 0; run--, update->done++ )
+			lcd->cell_seq[first + update->done] = update->seq;
+	}
+
+	mutex_unlock( &lcd->mutex );
+}
+
+/*
+ * description:		apply (part of) an update to the LCD.
+ * @return		true if the update is complete, false if it was preempted
+*/
+static bool lcd_apply_update(struct klcd_device *lcd, struct klcd_update *update)
+{
+	unsigned int line_end;
+	unsigned int i;
+
+	if( update->type == KLCD_UPDATE_BARRIER )
+		return true;
+
+	if( update->type == KLCD_UPDATE_COMMAND )
+	{
+		mutex_lock( &lcd->mutex );
+		update->command( lcd );
+		if( update->command == lcd_clearDisplay )
+			for( i = 0; i < lcd->cells; i++ )
+				lcd->cell_seq[i] = update->seq;
+		mutex_unlock( &lcd->mutex );
+		return true;
+	}
+
+	if( update->priority == LCD_NUM_PRIORITIES - 1 )	// nothing can preempt the highest lane
+	{
+		lcd_apply_cells( lcd, update, update->count );
+		return true;
+	}
+
+	// a line at a time: runs of cells never cross the end of a line, so each one is still sent in one go
+	while( update->done < update->count )
+	{
+		if( lcd_queue_preempted( lcd, update->priority ) )
+			return false;
+
+		line_end = update->cell + update->done + lcd->columns - (update->cell + update->done) % lcd->columns;
+		lcd_apply_cells( lcd, update, MIN( update->count, line_end - update->cell ) );
+	}
+
+	return true;
+}
+
+/*
+ * description:		record how far one bus transfer took longer than its nominal time.
+ *
+ * @param start		time the transfer started
+ * @param target_ns	nominal duration of the transfer
+*/
+static void lcd_bus_record_timing(struct klcd_device *lcd, ktime_t start, unsigned int target_ns)
+{
+	s64 elapsed   = ktime_to_ns( ktime_sub( ktime_get(), start ) );
+	u64 deviation = (elapsed > target_ns) ? elapsed - target_ns : 0;
+
+	lcd->bus_stats.nibbles++;
+	lcd->bus_stats.deviation_total_ns += deviation;
+	if( deviation > lcd->bus_stats.deviation_max_ns )
+		lcd->bus_stats.deviation_max_ns = deviation;
+}
+
+/*
+ * description:		apply queued updates until all lanes are empty. Runs in the bus thread.
+*/
+static void lcd_queue_run(struct klcd_device *lcd)
+{
+	struct klcd_update *update;
+	s64 latency_us;
+
+	while( (update = lcd_queue_peek( lcd )) != NULL )
+	{
+		if( !lcd_apply_update( lcd, update ) )
+			continue;			// preempted, serve the higher lane first
+
+		list_del( &update->list );
+
+		latency_us = ktime_to_us( ktime_sub( ktime_get(), update->submitted ) );
+
+		lcd->bus_stats.updates[update->priority]++;
+		if( latency_us > (s64) lcd->bus_stats.latency_max_us[update->priority] )
+			lcd->bus_stats.latency_max_us[update->priority] = latency_us;
+		if( latency_us > (s64) deadline_ms[update->priority] * USEC_PER_MSEC )
+			lcd->bus_stats.deadline_misses[update->priority]++;
+
+		lcd_queue_retire( lcd, update );
+	}
+}
+
+/*
+ * description:		check whether the bus thread has anything to do.
+*/
+static bool lcd_bus_pending(struct klcd_device *lcd)
+{
+	return kthread_should_stop() || lcd->bus_kick || lcd_queue_pending( lcd ) || lcd_play_pending( lcd ) || lcd_term_pending( lcd );
+}
+
+/*
+ * description:		the bus thread. Applies updates, then playlist frames that are due and terminal text, and runs
+ *			the scrubber while there is nothing else to do.
+*/
+static int lcd_bus_thread(void *data)
+{
+	struct klcd_device *lcd = data;
+	long timeout;
+
+	while( !kthread_should_stop() )
+	{
+		lcd->bus_kick = false;
+
+		lcd_queue_run( lcd );
+		lcd_play_run( lcd );
+		lcd_term_run( lcd );			// returns early when an update is queued
+
+		timeout = lcd_scrub_run( lcd );	// only runs when the queue is empty, returns the time to its next pass
+
+		if( !lcd_queue_pending( lcd ) && !lcd_term_pending( lcd ) )
+			lcd_cgram_settle( lcd );
+
+		wait_event_interruptible_timeout( lcd->bus_wait, lcd_bus_pending( lcd ), timeout );
+	}
+
+	return 0;
+}
+
+/*
+ * description:		wake the bus thread, e.g. after a change to the scrubber settings.
+*/
+static void lcd_bus_wake(struct klcd_device *lcd)
+{
+	lcd->bus_kick = true;
+	wake_up( &lcd->bus_wait );
+}
+
+/*
+ * description:		queue an update. Unless it is async, wait until it has been applied.
+*/
+static void lcd_queue_submit(struct klcd_device *lcd, struct klcd_update *update)
+{
+	if( update->priority >= LCD_NUM_PRIORITIES )
+		update->priority = LCD_NUM_PRIORITIES - 1;
+
+	update->done      = 0;
+	update->seq       = atomic_inc_return( &lcd->update_seq );
+	update->submitted = ktime_get();
+	if( !update->async )
+		init_completion( &update->completion );
+
+	// only the update that finds the inbox empty has to wake the bus thread
+	if( llist_add( &update->node, &lcd->inbox[update->priority] ) )
+		wake_up( &lcd->bus_wait );
+
+	if( !update->async )
+		wait_for_completion( &update->completion );
+}
+
+/*
+ * description:		get an update that the queue frees once it has been applied.
+ * @return		the update, or NULL if the caller has to use one of its own and wait for it
+ *			(out of memory, or LCD_QUEUE_MAX_ASYNC updates are waiting already)
+*/
+static struct klcd_update *lcd_queue_alloc(struct klcd_device *lcd)
+{
+	struct klcd_update *update;
+
+	if( atomic_inc_return( &lcd->queued_async ) > LCD_QUEUE_MAX_ASYNC )
+		goto full;
+
+	update = kmalloc( sizeof(*update), GFP_KERNEL );
+	if( update == NULL )
+		goto full;
+
+	update->async = true;
+	return update;
+
+full:
+	atomic_dec( &lcd->queued_async );
+	return NULL;
+}
+
+/*
+ * description:		queue new text for a range of cells and wait until it is shown.
+ *
+ * @param cell		linear cell index of the first character
+ * @param text		character codes (already translated) for the cells
+ * @param count		the number of cells. It is cut to the end of the screen.
+ * @param priority	KLCD_PRIORITY_NORMAL or KLCD_PRIORITY_ALERT
+*/
+static void lcd_queue_text(struct klcd_device *lcd, unsigned int cell, const char * text, unsigned int count, unsigned int priority)
+{
+	struct klcd_update local = { .async = false };
+	struct klcd_update *update;
+
+	if( cell >= lcd->cells )
+		return;
+	count = MIN( count, lcd->cells - cell );
+	if( count == 0 )
+		return;
+
+	update = lcd_queue_alloc( lcd );
+	if( update == NULL )
+		update = &local;
+
+	update->type     = KLCD_UPDATE_TEXT;
+	update->priority = priority;
+	update->cell     = cell;
+	update->count    = count;
+	memcpy( update->text, text, count );
+
+	lcd_queue_submit( lcd, update );
+}
+
+/*
+ * description:		queue a display command (clear, cursor on/off).
+ *
+ * @param command	one of lcd_clearDisplay, lcd_cursor_on or lcd_cursor_off
+ * @param priority	KLCD_PRIORITY_NORMAL or KLCD_PRIORITY_ALERT
+*/
+static void lcd_queue_command(struct klcd_device *lcd, void (*command)(struct klcd_device *lcd), unsigned int priority)
+{
+	struct klcd_update local = { .async = false };
+	struct klcd_update *update;
+
+	update = lcd_queue_alloc( lcd );
+	if( update == NULL )
+		update = &local;
+
+	update->type     = KLCD_UPDATE_COMMAND;
+	update->priority = priority;
+	update->command  = command;
+
+	lcd_queue_submit( lcd, update );
+}
+
+/*
+ * description:		run a command in the bus thread and wait until it has been sent, e.g. for its result.
+*/
+static void lcd_queue_command_wait(struct klcd_device *lcd, void (*command)(struct klcd_device *lcd), unsigned int priority)
+{
+	struct klcd_update update = { .async = false };
+
+	update.type     = KLCD_UPDATE_COMMAND;
+	update.priority = priority;
+	update.command  = command;
+
+	lcd_queue_submit( lcd, &update );
+}
+
+/*
+ * description:		wait until every update submitted so far has been applied.
+ *
+ * detail:		A barrier in the lowest lane completes after everything before it in its own lane, and
+ *			the higher lanes are always served first.
+*/
+static void lcd_queue_flush(struct klcd_device *lcd)
+{
+	struct klcd_update update = { .async = false };
+
+	update.type     = KLCD_UPDATE_BARRIER;
+	update.priority = KLCD_PRIORITY_NORMAL;
+
+	lcd_queue_submit( lcd, &update );
+}
+
+/*
+ * description:		start the bus thread with the priority and CPU given by the module parameters.
+ * @return		0 on success, or a negative error code
+*/
+static int lcd_queue_init(struct klcd_device *lcd)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,9,0)
+	struct sched_param param = { .sched_priority = bus_priority };
+#endif
+	unsigned int i;
+
+	for( i = 0; i < LCD_NUM_PRIORITIES; i++ ){
+		init_llist_head( &lcd->inbox[i] );
+		INIT_LIST_HEAD( &lcd->lanes[i] );
+	}
+	atomic_set( &lcd->queued_async, 0 );
+	atomic_set( &lcd->update_seq, 0 );
+	memset( lcd->cell_seq, 0, sizeof(lcd->cell_seq) );
+
+	if( bus_priority < 0 || bus_priority >= MAX_RT_PRIO ){
+		printk( KERN_DEBUG "ERR: Invalid bus thread priority %d \n", bus_priority );
+		return -EINVAL;
+	}
+	if( bus_cpu >= 0 && ( bus_cpu >= nr_cpu_ids || !cpu_online(bus_cpu) ) ){
+		printk( KERN_DEBUG "ERR: CPU %d is not online for the bus thread \n", bus_cpu );
+		return -EINVAL;
+	}
+
+	lcd->bus_task = kthread_create( lcd_bus_thread, lcd, "%s-bus", lcd->name );
+	if( IS_ERR(lcd->bus_task) )
+		return PTR_ERR( lcd->bus_task );
+
+	if( bus_cpu >= 0 )
+		kthread_bind( lcd->bus_task, bus_cpu );
+
+	if( bus_priority > 0 ){
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,9,0)
+		sched_setscheduler( lcd->bus_task, SCHED_FIFO, &param );
+		printk( KERN_INFO "klcd Driver: %s bus thread runs with SCHED_FIFO priority %d \n", lcd->name, bus_priority );
+#else
+		// modules can no longer pick the exact priority
+		sched_set_fifo( lcd->bus_task );
+		printk( KERN_NOTICE "klcd Driver: %s bus thread runs with SCHED_FIFO priority %d, bus_priority=%d is only "
+			"honoured before Linux 5.9 \n", lcd->name, MAX_RT_PRIO / 2, bus_priority );
+#endif
+	}
+
+	wake_up_process( lcd->bus_task );
+	return 0;
+}
+
+/*
+ * description:		stop the bus thread. No update can be queued any more at this point, and the async updates
+ *			that have not been applied are dropped.
+*/
+static void lcd_queue_exit(struct klcd_device *lcd)
+{
+	struct klcd_update *update;
+
+	kthread_stop( lcd->bus_task );
+
+	while( (update = lcd_queue_peek( lcd )) != NULL )
+	{
+		list_del( &update->list );
+		lcd_queue_retire( lcd, update );
+	}
+}
+
+
+// ************* Scrubber ************************************************************************
+
+/* Noise on long cables can change characters on the panel behind the driver's back. When the transport
+   can read from the LCD, a background pass reads a few cells of DDRAM at a time, compares them with the
+   shadow buffer and rewrites only the cells that differ. It runs in the bus thread, so it never overlaps
+   an update, and it skips its turn whenever an update is waiting. When the cursor is shown, it is put
+   back where it was after each pass.
+*/
+
+static unsigned int scrub_interval = 1000;
+module_param( scrub_interval, uint, S_IRUGO );
+MODULE_PARM_DESC( scrub_interval, "initial time between two scrubber passes in ms, 0 to disable (also /sys/class/klcd/klcd/scrub_interval)" );
+
+#define LCD_SCRUB_CELLS		4		// cells checked per pass, until changed in sysfs
+
+/*
+ * description:		put a visible cursor back where it was before a scrubber pass moved the address counter.
+ * @param address	DDRAM address before the pass
+*/
+static void lcd_scrub_restore_cursor(struct klcd_device *lcd, unsigned int address)
+{
+	int cell;
+
+	if( !lcd->cursor_visible || ( !lcd->address_cgram && lcd->address == address ) )
+		return;
+
+	cell = lcd_address_cell( lcd, address );
+	if( cell >= 0 )
+		lcd_plan_seek( lcd, cell );
+	else
+		lcd_command( lcd, 0x80 | address );		// e.g. just past the end of a line
+}
+
+/*
+ * description:		check the next few cells against the shadow buffer and repair them.
+ * @return		0 on success, or -ENODEV if the transport cannot read from the LCD
+*/
+static int lcd_scrub_pass(struct klcd_device *lcd)
+{
+	char panel[LCD_MAX_COLUMNS];
+	unsigned int cell = lcd->scrub_next;
+	unsigned int count;
+	unsigned int i;
+	unsigned int address;
+	bool address_cgram;
+	int ret;
+
+	count = MIN( lcd->scrub_cells, lcd->columns - cell % lcd->columns );	// stay on one line
+
+	mutex_lock( &lcd->mutex );
+
+	address       = lcd->address;
+	address_cgram = lcd->address_cgram;
+
+	ret = lcd_read_cells( lcd, cell, panel, count );
+	if( ret == 0 )
+	{
+		for( i = 0; i < count; i++ )
+		{
+			if( test_bit( cell + i, lcd->shadow_unknown ) ){	// after a warm attach the panel is right
+				write_seqlock( &lcd->shadow_lock );
+				lcd->shadow[cell + i] = panel[i];
+				clear_bit( cell + i, lcd->shadow_unknown );
+				write_sequnlock( &lcd->shadow_lock );
+				continue;
+			}
+			if( panel[i] == lcd->shadow[cell + i] )
+				continue;
+
+			lcd_plan_seek( lcd, cell + i );
+			lcd_data( lcd, lcd->shadow[cell + i] );
+			lcd->scrub_repaired++;
+		}
+	}
+
+	if( !address_cgram )		// the cursor is not on the screen while CGRAM is addressed
+		lcd_scrub_restore_cursor( lcd, address );
+
+	mutex_unlock( &lcd->mutex );
+
+	lcd->scrub_next = (cell + count) % lcd->cells;
+	return ret;
+}
+
+/*
+ * description:		run a scrubber pass if one is due. Called by the bus thread once the queue is empty.
+ * @return		time in jiffies until the next pass, MAX_SCHEDULE_TIMEOUT if the scrubber is stopped
+*/
+static long lcd_scrub_run(struct klcd_device *lcd)
+{
+	unsigned int interval = lcd->scrub_interval;
+
+	if( interval == 0 )
+		return MAX_SCHEDULE_TIMEOUT;
+
+	if( time_before( jiffies, lcd->scrub_due ) )
+		return lcd->scrub_due - jiffies;
+
+	if( lcd_queue_peek( lcd ) != NULL || lcd_term_pending( lcd ) )	// foreground updates always go first
+		return 1;
+
+	if( lcd_scrub_pass( lcd ) == -ENODEV ){
+		printk( KERN_INFO "klcd Driver: transport cannot read the LCD, scrubber stopped\n" );
+		lcd->scrub_interval = 0;
+		return MAX_SCHEDULE_TIMEOUT;
+	}
+
+	lcd->scrub_due = jiffies + msecs_to_jiffies( interval );
+	return msecs_to_jiffies( interval );
+}
+
+/*
+ * description:		change the time between two scrubber passes.
+ * @param interval	time in ms, 0 to stop the scrubber
+*/
+static void lcd_scrub_set_interval(struct klcd_device *lcd, unsigned int interval)
+{
+	lcd->scrub_due      = jiffies + msecs_to_jiffies( interval );
+	lcd->scrub_interval = interval;
+
+	lcd_bus_wake( lcd );
+}
+
+// ************* Timing Calibration **************************************************************
+
+/* HD44780 clones differ a lot in speed, and the default nibble_us is sized for the slowest of them. When
+   the LCD can be read back (rw_wired=1), the calibration shortens the nibble delay and then the E pulse
+   step by step. After each step it writes test patterns into DDRAM beyond the visible cells
+   (0x10 to 0x27 of the first line on a 16x2 LCD), checks the address counter and the busy flag, and reads
+   the patterns back. LCDs that show all of the first line of DDRAM (20x4, 40x2) cannot be calibrated. The fastest timing that passed is stored with calibrate_margin percent added on top.
+
+   A failed step may leave the 4-bit interface out of step, so the LCD is initialized again with the
+   last good timing and the screen is restored from the shadow buffer. The calibration runs as a command
+   on the bus thread, so no update can interleave with it.
+*/
+
+static bool calibrate;
+module_param( calibrate, bool, S_IRUGO );
+MODULE_PARM_DESC( calibrate, "calibrate the bus timing when the module is loaded (needs rw_wired=1)" );
+
+static unsigned int calibrate_margin = 50;
+module_param( calibrate_margin, uint, S_IRUGO );
+MODULE_PARM_DESC( calibrate_margin, "safety margin in percent added to the fastest timing that passed (default 50)" );
+
+/*
+ * description:		first DDRAM address of the first line that is not visible, where the test patterns go.
+ *			The patterns fill the line up to LCD_DDRAM_LINE_LENGTH.
+*/
+static unsigned int lcd_calibrate_address(struct klcd_device *lcd)
+{
+	return lcd_row_address( lcd, (lcd->rows > 2) ? 2 : 0 ) + lcd->columns;
+}
+
+/*
+ * description:		write test patterns beyond the visible cells and read them back. Called with lcd->mutex held.
+ * @return		0 if the LCD followed, -EIO if not, or -ENODEV if the transport cannot read from the LCD
+*/
+static int lcd_calibrate_verify(struct klcd_device *lcd)
+{
+	unsigned int address = lcd_calibrate_address( lcd );
+	unsigned int count   = LCD_DDRAM_LINE_LENGTH - address;
+	char pattern[LCD_DDRAM_LINE_LENGTH];
+	char panel[LCD_DDRAM_LINE_LENGTH];
+	char status;
+	unsigned int pass;
+	unsigned int i;
+	int ret;
+
+	for( pass = 0; pass < LCD_CALIBRATE_PASSES; pass++ )
+	{
+		for( i = 0; i < count; i++ )			// printable codes, different in every pass
+			pattern[i] = 0x20 + (i * 7 + pass * 31) % 0x5F;
+
+		lcd_command( lcd, 0x80 | address );
+		lcd_data_bulk( lcd, pattern, count );
+
+		/* The busy flag must be clear and the address counter must be right after the last character.
+		   The patterns end at the end of the DDRAM line, where the counter wraps to the next line
+		   (0x27 to 0x40), so the expected address is taken from the shadow buffer, which steps the
+		   counter the same way.
+		*/
+		ret = lcd->transport->read_bytes( lcd, RS_COMMAND_MODE, &status, 1 );
+		if( ret < 0 )
+			return ret;
+		if( (status & 0x80) || (status & 0x7F) != lcd->address )
+			return -EIO;
+
+		lcd_command( lcd, 0x80 | address );
+		ret = lcd->transport->read_bytes( lcd, RS_DATA_MODE, panel, count );
+		if( ret < 0 )
+			return ret;
+		lcd_shadow_data( lcd, NULL, count );
+
+		if( memcmp( pattern, panel, count ) )
+			return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * description:		bring the LCD back in step after a failed step and restore the screen. Called with lcd->mutex held.
+*/
+static void lcd_calibrate_recover(struct klcd_device *lcd)
+{
+	char screen[LCD_MAX_CELLS];
+	bool cursor_visible = lcd->cursor_visible;
+
+	memcpy( screen, lcd->shadow, lcd->cells );
+	lcd->calibrate_recoveries++;
+
+	lcd_initialize( lcd );			// the nibble sequence of the initialization resynchronizes 4-bit mode
+
+	lcd_update_cells( lcd, 0, screen, lcd->cells );
+	if( !cursor_visible )
+		lcd_cursor_off( lcd );
+}
+
+/*
+ * description:		try a timing.
+ * @return		0 if the LCD works with it, otherwise a negative error code and the LCD is back on *good
+*/
+static int lcd_calibrate_try(struct klcd_device *lcd, const struct klcd_timing *trial, const struct klcd_timing *good)
+{
+	int ret;
+
+	lcd->timing = *trial;
+
+	ret = lcd_calibrate_verify( lcd );
+	if( ret < 0 ){
+		lcd->timing = *good;
+		lcd_calibrate_recover( lcd );
+	}
+
+	return ret;
+}
+
+/*
+ * description:		find the fastest reliable timing. Runs on the bus thread as a KLCD_UPDATE_COMMAND.
+*/
+static void lcd_calibrate(struct klcd_device *lcd)
+{
+	struct klcd_timing good = lcd->timing;
+	struct klcd_timing trial;
+	int ret;
+
+	// the current timing must pass before anything is shortened
+	ret = lcd_calibrate_try( lcd, &good, &good );
+	if( ret < 0 ){
+		lcd->calibrate_result = ret;
+		return;
+	}
+
+	for( ;; )
+	{
+		trial = good;
+		trial.nibble_us = good.nibble_us * 3 / 4;
+		if( trial.nibble_us < LCD_CALIBRATE_MIN_US || trial.nibble_us == good.nibble_us )
+			break;
+		if( lcd_calibrate_try( lcd, &trial, &good ) < 0 )
+			break;
+		good = trial;
+	}
+
+	for( ;; )
+	{
+		trial = good;
+		trial.pulse_us = good.pulse_us - 1;
+		if( trial.pulse_us < LCD_CALIBRATE_MIN_US )
+			break;
+		if( lcd_calibrate_try( lcd, &trial, &good ) < 0 )
+			break;
+		good = trial;
+	}
+
+	// store the fastest timing with the safety margin (rounded up, at least 1 us more)
+	lcd->timing.nibble_us = good.nibble_us + MAX( DIV_ROUND_UP( good.nibble_us * calibrate_margin, 100 ), 1U );
+	lcd->timing.pulse_us  = good.pulse_us  + MAX( DIV_ROUND_UP( good.pulse_us  * calibrate_margin, 100 ), 1U );
+	lcd_timing_clamp( &lcd->timing );
+	lcd->timing_calibrated = true;
+	lcd->calibrate_result  = 0;
+
+	printk( KERN_INFO "klcd Driver: %s calibrated to nibble_us %u pulse_us %u\n", lcd->name, lcd->timing.nibble_us, lcd->timing.pulse_us );
+}
+
+/*
+ * description:		calibrate the bus timing and wait for the result.
+ * @return		0 on success, -ENODEV if the LCD cannot be read back, -ENOSPC if all of its DDRAM is visible,
+ *			or -EIO if even the current timing fails
+*/
+static int lcd_calibrate_run(struct klcd_device *lcd)
+{
+	if( lcd->transport->read_bytes == NULL || ( lcd->transport == &lcd_gpio_transport && !lcd->rw_wired ) )
+		return -ENODEV;
+	if( LCD_DDRAM_LINE_LENGTH - lcd_calibrate_address( lcd ) < LCD_CALIBRATE_MIN_CELLS )
+		return -ENOSPC;			// no DDRAM left for the test patterns
+
+	lcd_queue_command_wait( lcd, lcd_calibrate, KLCD_PRIORITY_NORMAL );
+
+	return lcd->calibrate_result;
+}
+
+
+
+// ************* Character Translation ***********************************************************
+
+/* Text reaches the driver as UTF-8. Every code point is turned into an HD44780 character code with a
+   two-level lookup table (256 pages of 256 entries each, covering the Basic Multilingual Plane),
+   built once at module load for the character ROM fitted to the panel. An entry holds the ROM
+   code in its low byte and an optional second cell (a dakuten/handakuten mark for katakana) in its
+   high byte; 0 means the character is not in the ROM.
+
+   Characters that are not in the ROM but have a bitmap in lcd_fallback_glyphs[] are loaded into one
+   of the 8 CGRAM glyphs on first use and then printed from there. Anything else is shown as '?'.
+*/
+
+#define LCD_ROM_CODE(c)		(c)
+#define LCD_ROM_DAKUTEN(c)	((c) | (0xDE << 8))	// followed by a voiced sound mark
+#define LCD_ROM_HANDAKUTEN(c)	((c) | (0xDF << 8))	// followed by a semi-voiced sound mark
+
+struct klcd_rom_char
+{
+	u16 codepoint;
+	u16 code;		// see LCD_ROM_CODE()
+};
+
+/* ROM code A00 (Japanese standard font) */
+static const struct klcd_rom_char lcd_rom_a00_chars[] =
+{
+	{ 0x00A5, 0x5C },	// YEN SIGN replaces the backslash
+	{ 0x2192, 0x7E },	// RIGHTWARDS ARROW replaces the tilde
+	{ 0x2190, 0x7F },	// LEFTWARDS ARROW
+
+	{ 0x3002, 0xA1 }, { 0x300C, 0xA2 }, { 0x300D, 0xA3 }, { 0x3001, 0xA4 }, { 0x30FB, 0xA5 },
+	{ 0x30FC, 0xB0 }, { 0x309B, 0xDE }, { 0x309C, 0xDF }, { 0x00B0, 0xDF },
+
+	{ 0x03B1, 0xE0 }, { 0x00E4, 0xE1 }, { 0x03B2, 0xE2 }, { 0x00DF, 0xE2 }, { 0x03B5, 0xE3 },
+	{ 0x03BC, 0xE4 }, { 0x00B5, 0xE4 }, { 0x03C3, 0xE5 }, { 0x03C1, 0xE6 }, { 0x221A, 0xE8 },
+	{ 0x00A2, 0xEC }, { 0x00A3, 0xED }, { 0x00F1, 0xEE }, { 0x00F6, 0xEF }, { 0x03B8, 0xF2 },
+	{ 0x221E, 0xF3 }, { 0x03A9, 0xF4 }, { 0x2126, 0xF4 }, { 0x00FC, 0xF5 }, { 0x03A3, 0xF6 },
+	{ 0x03C0, 0xF7 }, { 0x5343, 0xFA }, { 0x4E07, 0xFB }, { 0x5186, 0xFC }, { 0x00F7, 0xFD },
+	{ 0x2588, 0xFF },
+};
+
+/* Full width katakana U+30A1 to U+30F4, mapped onto the half width katakana of ROM code A00 */
+static const u16 lcd_rom_a00_katakana[] =
+{
+	0xA7, 0xB1, 0xA8, 0xB2, 0xA9, 0xB3, 0xAA, 0xB4, 0xAB, 0xB5,			// ァアィイゥウェエォオ
+	0xB6, LCD_ROM_DAKUTEN(0xB6), 0xB7, LCD_ROM_DAKUTEN(0xB7),			// カガキギ
+	0xB8, LCD_ROM_DAKUTEN(0xB8), 0xB9, LCD_ROM_DAKUTEN(0xB9),			// クグケゲ
+	0xBA, LCD_ROM_DAKUTEN(0xBA), 0xBB, LCD_ROM_DAKUTEN(0xBB),			// コゴサザ
+	0xBC, LCD_ROM_DAKUTEN(0xBC), 0xBD, LCD_ROM_DAKUTEN(0xBD),			// シジスズ
+	0xBE, LCD_ROM_DAKUTEN(0xBE), 0xBF, LCD_ROM_DAKUTEN(0xBF),			// セゼソゾ
+	0xC0, LCD_ROM_DAKUTEN(0xC0), 0xC1, LCD_ROM_DAKUTEN(0xC1),			// タダチヂ
+	0xAF, 0xC2, LCD_ROM_DAKUTEN(0xC2), 0xC3, LCD_ROM_DAKUTEN(0xC3),		// ッツヅテデ
+	0xC4, LCD_ROM_DAKUTEN(0xC4), 0xC5, 0xC6, 0xC7, 0xC8, 0xC9,			// トドナニヌネノ
+	0xCA, LCD_ROM_DAKUTEN(0xCA), LCD_ROM_HANDAKUTEN(0xCA),				// ハバパ
+	0xCB, LCD_ROM_DAKUTEN(0xCB), LCD_ROM_HANDAKUTEN(0xCB),				// ヒビピ
+	0xCC, LCD_ROM_DAKUTEN(0xCC), LCD_ROM_HANDAKUTEN(0xCC),				// フブプ
+	0xCD, LCD_ROM_DAKUTEN(0xCD), LCD_ROM_HANDAKUTEN(0xCD),				// ヘベペ
+	0xCE, LCD_ROM_DAKUTEN(0xCE), LCD_ROM_HANDAKUTEN(0xCE),				// ホボポ
+	0xCF, 0xD0, 0xD1, 0xD2, 0xD3,							// マミムメモ
+	0xAC, 0xD4, 0xAD, 0xD5, 0xAE, 0xD6,						// ャヤュユョヨ
+	0xD7, 0xD8, 0xD9, 0xDA, 0xDB,							// ラリルレロ
+	0xDC, 0xDC, 0x00, 0x00, 0xA6, 0xDD, LCD_ROM_DAKUTEN(0xB3),			// ヮワヰヱヲンヴ
+};
+
+/* ROM code A02 (European standard font). 0x20-0x7E and 0xA0-0xFF follow ASCII and ISO 8859-1 */
+static const struct klcd_rom_char lcd_rom_a02_chars[] =
+{
+	{ 0x0411, 0x80 }, { 0x0414, 0x81 }, { 0x0416, 0x82 }, { 0x0417, 0x83 }, { 0x0418, 0x84 },
+	{ 0x0419, 0x85 }, { 0x041B, 0x86 }, { 0x041F, 0x87 }, { 0x0423, 0x88 }, { 0x0426, 0x89 },
+	{ 0x0427, 0x8A }, { 0x0428, 0x8B }, { 0x0429, 0x8C }, { 0x042A, 0x8D }, { 0x042B, 0x8E },
+	{ 0x042D, 0x8F },
+
+	{ 0x0410, 'A' }, { 0x0412, 'B' }, { 0x0415, 'E' }, { 0x041A, 'K' }, { 0x041C, 'M' },	// Cyrillic letters
+	{ 0x041D, 'H' }, { 0x041E, 'O' }, { 0x0420, 'P' }, { 0x0421, 'C' }, { 0x0422, 'T' },	// that look like
+	{ 0x0425, 'X' },									// Latin ones
+
+	{ 0x03B1, 0x90 }, { 0x266A, 0x91 }, { 0x0393, 0x92 }, { 0x03C0, 0x93 }, { 0x03A3, 0x94 },
+	{ 0x03C3, 0x95 }, { 0x03C4, 0x97 }, { 0x0398, 0x99 }, { 0x03A9, 0x9A }, { 0x2126, 0x9A },
+	{ 0x03B4, 0x9B }, { 0x221E, 0x9C }, { 0x2665, 0x9D }, { 0x03B5, 0x9E }, { 0x2229, 0x9F },
+};
+
+/* 5x8 bitmaps (one row per byte, top row first) for characters that are missing from a ROM */
+static const struct
+{
+	u32 codepoint;
+	u8  rows[8];
+} lcd_fallback_glyphs[] =
+{
+	{ '\\',   { 0x00, 0x10, 0x08, 0x04, 0x02, 0x01, 0x00, 0x00 } },
+	{ '~',    { 0x00, 0x00, 0x08, 0x15, 0x02, 0x00, 0x00, 0x00 } },
+	{ 0x00C4, { 0x0A, 0x00, 0x0E, 0x11, 0x11, 0x1F, 0x11, 0x00 } },	// Ä
+	{ 0x00D6, { 0x0A, 0x00, 0x0E, 0x11, 0x11, 0x11, 0x0E, 0x00 } },	// Ö
+	{ 0x00DC, { 0x0A, 0x00, 0x11, 0x11, 0x11, 0x11, 0x0E, 0x00 } },	// Ü
+	{ 0x00E0, { 0x08, 0x04, 0x0E, 0x01, 0x0F, 0x11, 0x0F, 0x00 } },	// à
+	{ 0x00E7, { 0x00, 0x0E, 0x10, 0x10, 0x11, 0x0E, 0x04, 0x0C } },	// ç
+	{ 0x00E8, { 0x08, 0x04, 0x0E, 0x11, 0x1F, 0x10, 0x0E, 0x00 } },	// è
+	{ 0x00E9, { 0x02, 0x04, 0x0E, 0x11, 0x1F, 0x10, 0x0E, 0x00 } },	// é
+	{ 0x20AC, { 0x06, 0x09, 0x1C, 0x08, 0x1C, 0x09, 0x06, 0x00 } },	// €
+};
+
+static char *rom = "a00";
+module_param( rom, charp, S_IRUGO );
+MODULE_PARM_DESC( rom, "character ROM of the LCD controller: a00 (Japanese, default) or a02 (European)" );
+
+static u8  lcd_rom_directory[LCD_ROM_DIRECTORY_SIZE];	// page number + 1 for each 256 code points, 0 if empty
+static u16 lcd_rom_pages[LCD_ROM_MAX_PAGES][LCD_ROM_PAGE_SIZE];
+static unsigned int lcd_rom_num_pages;
+
+
+/*
+ * description:		enter one code point into the lookup table, allocating its page if needed.
+*/
+static int lcd_rom_set(u32 codepoint, u16 code)
+{
+	unsigned int page = codepoint / LCD_ROM_PAGE_SIZE;
+
+	if( lcd_rom_directory[page] == 0 )
+	{
+		if( lcd_rom_num_pages >= LCD_ROM_MAX_PAGES ){
+			printk( KERN_DEBUG "ERR: Character ROM table is full \n" );
+			return -ENOSPC;
+		}
+		lcd_rom_directory[page] = ++lcd_rom_num_pages;
+	}
+
+	lcd_rom_pages[ lcd_rom_directory[page] - 1 ][ codepoint % LCD_ROM_PAGE_SIZE ] = code;
+	return 0;
+}
+
+/*
+ * description:		build the code point lookup table for the ROM named by the "rom" module parameter.
+ *
+ * @return		0 on success, or a negative error code
+*/
+static int lcd_rom_build(void)
+{
+	const struct klcd_rom_char *chars;
+	unsigned int num_chars;
+	unsigned int i;
+	int ret = 0;
+
+	memset( lcd_rom_directory, 0, sizeof(lcd_rom_directory) );
+	memset( lcd_rom_pages, 0, sizeof(lcd_rom_pages) );
+	lcd_rom_num_pages = 0;
+
+	for( i = 0x20; i < 0x7E; i++ )			// printable ASCII is common to both ROMs
+		ret |= lcd_rom_set( i, LCD_ROM_CODE(i) );
+
+	if( strcmp( rom, "a00" ) == 0 )
+	{
+		ret |= lcd_rom_set( '\\', 0 );		// 0x5C is the yen sign on A00
+
+		for( i = 0xFF61; i <= 0xFF9F; i++ )	// half width katakana are in JIS X 0201 order
+			ret |= lcd_rom_set( i, LCD_ROM_CODE(0xA1 + i - 0xFF61) );
+
+		for( i = 0; i < ARRAY_SIZE(lcd_rom_a00_katakana); i++ )
+			ret |= lcd_rom_set( 0x30A1 + i, lcd_rom_a00_katakana[i] );
+
+		chars     = lcd_rom_a00_chars;
+		num_chars = ARRAY_SIZE(lcd_rom_a00_chars);
+	}
+	else if( strcmp( rom, "a02" ) == 0 )
+	{
+		ret |= lcd_rom_set( '~', LCD_ROM_CODE('~') );
+
+		for( i = 0xA1; i <= 0xFF; i++ )
+			ret |= lcd_rom_set( i, LCD_ROM_CODE(i) );
+
+		chars     = lcd_rom_a02_chars;
+		num_chars = ARRAY_SIZE(lcd_rom_a02_chars);
+	}
+	else
+	{
+		printk( KERN_DEBUG "ERR: Unknown character ROM \"%s\" \n", rom );
+		return -EINVAL;
+	}
+
+	for( i = 0; i < num_chars; i++ )
+		ret |= lcd_rom_set( chars[i].codepoint, chars[i].code );
+
+	return ret ? -ENOSPC : 0;
+}
+
+/*
+ * description:		look up a code point in the character ROM table.
+ *
+ * @return		see LCD_ROM_CODE(), or 0 if the ROM does not have the character
+*/
+static u16 lcd_rom_lookup(u32 codepoint)
+{
+	unsigned int page;
+
+	if( codepoint >= LCD_ROM_DIRECTORY_SIZE * LCD_ROM_PAGE_SIZE )
+		return 0;
+
+	page = lcd_rom_directory[ codepoint / LCD_ROM_PAGE_SIZE ];
+	if( page == 0 )
+		return 0;
+
+	return lcd_rom_pages[ page - 1 ][ codepoint % LCD_ROM_PAGE_SIZE ];
+}
+
+/*
+ * description:		find a CGRAM glyph that is no longer shown anywhere on the screen. Called with lcd->cgram_lock held.
+ *
+ * @param claimed	glyphs that must be kept even if not shown yet (bit n for glyph n)
+ * @return		the glyph number, or -1 if every glyph is still in use
+*/
+static int lcd_cgram_reclaim(struct klcd_device *lcd, unsigned int claimed)
+{
+	char screen[LCD_MAX_CELLS];
+	unsigned int shown = claimed;
+	unsigned int seq;
+	bool unknown;
+	unsigned int i;
+
+	do{
+		seq = read_seqbegin( &lcd->shadow_lock );
+		unknown = !bitmap_empty( lcd->shadow_unknown, lcd->cells );
+		memcpy( screen, lcd->shadow, lcd->cells );
+	} while( read_seqretry( &lcd->shadow_lock, seq ) );
+
+	// cells not known since a warm attach may show any glyph
+	if( unknown )
+		return -1;
+
+	for( i = 0; i < LCD_CGRAM_GLYPHS; i++ )
+	{
+		if( lcd->cgram_slots[i].pinned )
+			shown |= 1 << i;
+	}
+	shown |= lcd->cgram_queued;		// not on the screen yet, but on its way
+
+	for( i = 0; i < lcd->cells; i++ )
+	{
+		if( (unsigned char) screen[i] < 2 * LCD_CGRAM_GLYPHS )	// 0x00-0x07 and their aliases 0x08-0x0F
+			shown |= 1 << (screen[i] % LCD_CGRAM_GLYPHS);
+	}
+
+	for( i = 0; i < LCD_CGRAM_GLYPHS; i++ )
+	{
+		if( !(shown & (1 << i)) )
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * description:		find a CGRAM glyph for a character, loading its bitmap into a free glyph if needed.
+ *
+ * @param codepoint	the character
+ * @param rows		5x8 bitmap of the character, one row per byte, top row first
+ * @param claimed	glyphs in use by the caller (bit n for glyph n). Updated with the glyph returned,
+ *			so that it is not reclaimed before the caller has printed it.
+ *
+ * @return		the character code to print the glyph with, or -ENOSPC if every glyph is in use
+ *
+ * detail:		CGRAM glyphs are printed with the character codes 0x08-0x0F rather than 0x00-0x07 so that
+ *			a translated string never contains a '\0'. The bitmap only goes to the LCD once the bus
+ *			thread calls lcd_cgram_sync(), before it prints the next cells. Called with lcd->cgram_lock held.
+*/
+static int lcd_cgram_load(struct klcd_device *lcd, u32 codepoint, const u8 *rows, unsigned int *claimed)
+{
+	unsigned int i;
+	int slot = -1;
+
+	for( i = 0; i < LCD_CGRAM_GLYPHS; i++ )
+	{
+		if( lcd->cgram_slots[i].used && lcd->cgram_slots[i].codepoint == codepoint ){
+			*claimed |= 1 << i;
+			lcd->cgram_queued |= 1 << i;
+			return LCD_CGRAM_CHAR_BASE + i;
+		}
+		if( !lcd->cgram_slots[i].used && slot < 0 )
+			slot = i;
+	}
+
+	if( slot < 0 )
+		slot = lcd_cgram_reclaim( lcd, *claimed );
+	if( slot < 0 )
+		return -ENOSPC;
+
+	memcpy( lcd->cgram_rows + (slot << 3), rows, 8 );
+	lcd->cgram_dirty  |= 1 << slot;
+	lcd->cgram_queued |= 1 << slot;
+
+	lcd->cgram_slots[slot].codepoint = codepoint;
+	lcd->cgram_slots[slot].used      = true;
+	lcd->cgram_slots[slot].pinned    = 0;
+	*claimed |= 1 << slot;
+
+	return LCD_CGRAM_CHAR_BASE + slot;
+}
+
+/*
+ * description:		find (or load) a CGRAM glyph for a character that the ROM does not have.
+ *
+ * @param claimed	see lcd_cgram_load()
+ * @return		the character code to print the glyph with, or -ENOENT if no glyph is available
+*/
+static int lcd_cgram_glyph(struct klcd_device *lcd, u32 codepoint, unsigned int *claimed)
+{
+	unsigned int i;
+	int code;
+
+	for( i = 0; i < ARRAY_SIZE(lcd_fallback_glyphs); i++ )
+	{
+		if( lcd_fallback_glyphs[i].codepoint == codepoint ){
+			code = lcd_cgram_load( lcd, codepoint, lcd_fallback_glyphs[i].rows, claimed );
+			return (code < 0) ? -ENOENT : code;
+		}
+	}
+
+	return -ENOENT;
+}
+
+/*
+ * description:		load a glyph and keep it in CGRAM until lcd_cgram_unpin(), whether it is shown or not.
+ * @return		the character code to print the glyph with, or -ENOSPC if every glyph is in use
+*/
+static int lcd_cgram_pin(struct klcd_device *lcd, u32 codepoint, const u8 *rows)
+{
+	unsigned int claimed = 0;
+	int code;
+
+	code = lcd_cgram_load( lcd, codepoint, rows, &claimed );
+	if( code >= 0 )
+		lcd->cgram_slots[code - LCD_CGRAM_CHAR_BASE].pinned++;
+
+	return code;
+}
+
+/*
+ * description:		drop a reference taken by lcd_cgram_pin().
+*/
+static void lcd_cgram_unpin(struct klcd_device *lcd, u32 codepoint)
+{
+	unsigned int i;
+
+	for( i = 0; i < LCD_CGRAM_GLYPHS; i++ )
+	{
+		if( lcd->cgram_slots[i].used && lcd->cgram_slots[i].codepoint == codepoint && lcd->cgram_slots[i].pinned )
+			lcd->cgram_slots[i].pinned--;
+	}
+}
+
+/*
+ * description:		change the bitmap of a loaded glyph in place. Every cell showing it changes with it.
+ * @return		the character code of the glyph, or -ENOENT if it is not loaded
+*/
+static int lcd_cgram_redefine(struct klcd_device *lcd, u32 codepoint, const u8 *rows)
+{
+	unsigned int i;
+
+	for( i = 0; i < LCD_CGRAM_GLYPHS; i++ )
+	{
+		if( !lcd->cgram_slots[i].used || lcd->cgram_slots[i].codepoint != codepoint )
+			continue;
+
+		if( memcmp( lcd->cgram_rows + (i << 3), rows, 8 ) ){
+			memcpy( lcd->cgram_rows + (i << 3), rows, 8 );
+			lcd->cgram_dirty |= 1 << i;
+		}
+		return LCD_CGRAM_CHAR_BASE + i;
+	}
+
+	return -ENOENT;
+}
+
+/*
+ * description:		send the glyph bitmaps that changed since the last call. Called with lcd->mutex held, by
+ *			lcd_update_cells() before it prints, so a cell never shows a glyph before its bitmap is in CGRAM.
+ *
+ * detail:		Moves the address counter into CGRAM; lcd_update_cells() sets a DDRAM address again.
+*/
+static void lcd_cgram_sync(struct klcd_device *lcd)
+{
+	u8 rows[LCD_CGRAM_SIZE];
+	unsigned int dirty;
+	unsigned int i;
+
+	if( lcd->cgram_dirty == 0 )	// set before the update that needs the glyph is submitted
+		return;
+
+	mutex_lock( &lcd->cgram_lock );
+	dirty = lcd->cgram_dirty;
+	lcd->cgram_dirty = 0;
+	memcpy( rows, lcd->cgram_rows, sizeof(rows) );
+	mutex_unlock( &lcd->cgram_lock );
+
+	for( i = 0; i < LCD_CGRAM_GLYPHS; i++ )
+	{
+		if( !(dirty & (1 << i)) )
+			continue;
+
+		lcd_command( lcd, 0x40 | (i << 3) );	// Set CGRAM address to the first row of the glyph
+		lcd_data_bulk( lcd, (const char *) rows + (i << 3), 8 );
+	}
+}
+
+/*
+ * description:		release all CGRAM glyphs that are not pinned. Called once nothing on the screen refers to
+ *			them any more, with lcd->cgram_lock held.
+*/
+static void lcd_cgram_reset(struct klcd_device *lcd)
+{
+	unsigned int i;
+
+	for( i = 0; i < LCD_CGRAM_GLYPHS; i++ )
+	{
+		if( !lcd->cgram_slots[i].pinned && !(lcd->cgram_queued & (1 << i)) )
+			lcd->cgram_slots[i].used = false;
+	}
+}
+
+/*
+ * description:		forget which glyphs were handed out for queued text. Called by the bus thread once everything
+ *			submitted has been applied, when any text using them is in the shadow buffer.
+ *
+ * detail:		A caller that has translated its text but not queued it yet still counts as a submitter,
+ *			so its glyphs stay until the next time the bus thread runs out of work.
+*/
+static void lcd_cgram_settle(struct klcd_device *lcd)
+{
+	if( lcd->cgram_queued == 0 )
+		return;
+
+	mutex_lock( &lcd->cgram_lock );
+	if( lcd->cgram_submitters == 0 && !lcd_queue_pending( lcd ) )	// submitters queue before they leave
+		lcd->cgram_queued = 0;
+	mutex_unlock( &lcd->cgram_lock );
+}
+
+/*
+ * description:		start translating text for an update. Glyphs handed out by lcd_translate() are not
+ *			settled before the matching lcd_translate_end(), which the caller makes once the text is queued.
+*/
+static void lcd_translate_begin(struct klcd_device *lcd)
+{
+	mutex_lock( &lcd->cgram_lock );
+	lcd->cgram_submitters++;
+	mutex_unlock( &lcd->cgram_lock );
+}
+
+/*
+ * description:		the text translated since lcd_translate_begin() is queued (or dropped).
+*/
+static void lcd_translate_end(struct klcd_device *lcd)
+{
+	mutex_lock( &lcd->cgram_lock );
+	lcd->cgram_submitters--;
+	mutex_unlock( &lcd->cgram_lock );
+}
+
+/*
+ * description:		decode one UTF-8 sequence.
+ *
+ * @param s		bytes to be decoded
+ * @param len		the number of bytes available in s
+ * @param codepoint	the decoded code point, or LCD_INVALID_CODEPOINT for a malformed sequence
+ *
+ * @return		the number of bytes consumed, or 0 if s ends in the middle of a sequence
+*/
+static unsigned int lcd_utf8_decode(const char *s, unsigned int len, u32 *codepoint)
+{
+	const unsigned char *p = (const unsigned char *) s;
+	unsigned int length;
+	unsigned int i;
+	u32 cp;
+
+	if( p[0] < 0x80 ){
+		*codepoint = p[0];
+		return 1;
+	}
+	else if( (p[0] & 0xE0) == 0xC0 ){
+		length = 2;
+		cp = p[0] & 0x1F;
+	}
+	else if( (p[0] & 0xF0) == 0xE0 ){
+		length = 3;
+		cp = p[0] & 0x0F;
+	}
+	else if( (p[0] & 0xF8) == 0xF0 ){
+		length = 4;
+		cp = p[0] & 0x07;
+	}
+	else{
+		*codepoint = LCD_INVALID_CODEPOINT;
+		return 1;
+	}
+
+	for( i = 1; i < length; i++ )
+	{
+		if( i >= len )
+			return 0;
+
+		if( (p[i] & 0xC0) != 0x80 ){
+			*codepoint = LCD_INVALID_CODEPOINT;
+			return i;
+		}
+		cp = (cp << 6) | (p[i] & 0x3F);
+	}
+
+	// reject overlong encodings, UTF-16 surrogates and values beyond U+10FFFF
+	if( (length == 2 && cp < 0x80) || (length == 3 && cp < 0x800) || (length == 4 && cp < 0x10000) ||
+	    (cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF )
+		cp = LCD_INVALID_CODEPOINT;
+
+	*codepoint = cp;
+	return length;
+}
+
+/*
+ * description:		length of a UTF-8 buffer without a multi-byte sequence that is cut off at its end.
+ * @return		len, or the offset of the lead byte of the incomplete sequence
+*/
+static size_t lcd_utf8_complete(const char *s, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) s;
+	size_t lead = len;
+	u32 codepoint;
+
+	// step back over at most 3 continuation bytes to the lead byte of the last sequence
+	while( lead > 0 && len - lead < 3 && (p[lead - 1] & 0xC0) == 0x80 )
+		lead--;
+	if( lead == 0 || p[lead - 1] < 0xC0 )
+		return len;
+	lead--;
+
+	return lcd_utf8_decode( s + lead, len - lead, &codepoint ) == 0 ? lead : len;
+}
+
+/*
+ * description:		translate a UTF-8 string into HD44780 character codes.
+ *
+ * @param msg		a '\0' terminated UTF-8 string. It is translated in place, since the translated string
+ *			is never longer than its UTF-8 encoding.
+ *
+ * detail:		A sequence cut off at the end of the string (e.g. by MAX_BUF_LENGTH) is dropped.
+ *			Takes lcd->cgram_lock, but never waits for the bus: new glyphs are sent by the bus thread.
+ *			Callers other than the bus thread translate between lcd_translate_begin() and lcd_translate_end().
+*/
+static void lcd_translate(struct klcd_device *lcd, char * msg)
+{
+	unsigned int len = strlen(msg);
+	unsigned int in  = 0;
+	unsigned int out = 0;
+	unsigned int used;
+	u32 codepoint;
+	u16 code;
+	unsigned int claimed = 0;
+	int glyph;
+
+	mutex_lock( &lcd->cgram_lock );
+
+	while( in < len )
+	{
+		used = lcd_utf8_decode( msg + in, len - in, &codepoint );
+		if( used == 0 )
+			break;
+		in += used;
+
+		code = lcd_rom_lookup( codepoint );
+		if( code != 0 ){
+			msg[out++] = (char) (code & 0xFF);
+			if( code >> 8 )
+				msg[out++] = (char) (code >> 8);
+			continue;
+		}
+
+		glyph = lcd_cgram_glyph( lcd, codepoint, &claimed );
+		msg[out++] = (glyph < 0) ? LCD_UNKNOWN_CHAR : (char) glyph;
+	}
+
+	msg[out] = '\0';
+
+	mutex_unlock( &lcd->cgram_lock );
+}
+
+
+
+// ************* Widgets *************************************************************************
+
+/* Bargraphs and numeric fields are defined once with IOCTL_DEFINE_WIDGET and then updated by value with
+   IOCTL_SET_WIDGET. The driver renders the widget into its cells and queues them as a text update, so
+   only the cells whose character changes are sent to the LCD (usually one or two per update). The update
+   is queued before widget_lock is dropped, so the panel ends up with the value that was set last.
+
+   A bargraph has 5 steps per cell. Partially filled cells use CGRAM glyphs with 1 to 4 columns set;
+   full cells use the ROM block character if the ROM has one, otherwise a fifth glyph. The glyphs are
+   pinned in CGRAM for as long as any bargraph is defined.
+*/
+
+
+/*
+ * description:		load the bargraph glyphs into CGRAM. Called with lcd->widget_lock held.
+ * @return		0 on success, or -ENOSPC if there is not enough free CGRAM
+*/
+static int lcd_bar_glyphs_get(struct klcd_device *lcd)
+{
+	u8 rows[8];
+	unsigned int columns;
+	u16 block;
+	int code;
+
+	if( lcd->num_bargraphs++ > 0 )
+		return 0;
+
+	lcd->bar_codes[0] = ' ';
+
+	mutex_lock( &lcd->cgram_lock );
+
+	block = lcd_rom_lookup( 0x2588 );			// FULL BLOCK
+	if( block != 0 )
+		lcd->bar_codes[LCD_BAR_STEPS] = (char) block;
+
+	for( columns = 1; columns <= LCD_BAR_STEPS; columns++ )
+	{
+		if( columns == LCD_BAR_STEPS && block != 0 )
+			break;
+
+		memset( rows, (0x1F << (LCD_BAR_STEPS - columns)) & 0x1F, sizeof(rows) );	// left columns set
+
+		code = lcd_cgram_pin( lcd, LCD_BAR_CODEPOINT(columns), rows );
+		if( code < 0 ){
+			while( --columns > 0 )
+				lcd_cgram_unpin( lcd, LCD_BAR_CODEPOINT(columns) );
+			mutex_unlock( &lcd->cgram_lock );
+			lcd->num_bargraphs--;
+			return -ENOSPC;
+		}
+		lcd->bar_codes[columns] = (char) code;
+	}
+
+	mutex_unlock( &lcd->cgram_lock );
+	return 0;
+}
+
+/*
+ * description:		release the bargraph glyphs once the last bargraph is removed. Called with lcd->widget_lock held.
+*/
+static void lcd_bar_glyphs_put(struct klcd_device *lcd)
+{
+	unsigned int columns;
+
+	if( --lcd->num_bargraphs > 0 )
+		return;
+
+	mutex_lock( &lcd->cgram_lock );
+	for( columns = 1; columns <= LCD_BAR_STEPS; columns++ )
+		lcd_cgram_unpin( lcd, LCD_BAR_CODEPOINT(columns) );
+	mutex_unlock( &lcd->cgram_lock );
+}
+
+/*
+ * description:		render a widget into character codes. Called with lcd->widget_lock held.
+ * @param text		buffer for widget->width character codes
+*/
+static void lcd_widget_render(struct klcd_device *lcd, const struct klcd_widget *widget, char *text)
+{
+	char number[12];
+	unsigned int steps;
+	unsigned int len;
+	unsigned int i;
+	int value;
+
+	if( widget->type == KLCD_WIDGET_BARGRAPH )
+	{
+		// min < max is checked when the widget is defined, and the differences do not fit an int for wide ranges
+		value = clamp( widget->value, widget->min, widget->max );
+		steps = (unsigned int) div_u64( (u64) ((s64) value - widget->min) * widget->width * LCD_BAR_STEPS,
+						(u32) ((s64) widget->max - widget->min) );
+
+		for( i = 0; i < widget->width; i++ )
+			text[i] = lcd->bar_codes[ clamp_t( int, (int) steps - (int) (i * LCD_BAR_STEPS), 0, LCD_BAR_STEPS ) ];
+		return;
+	}
+
+	// KLCD_WIDGET_NUMBER: right aligned, all '*' if it does not fit
+	len = snprintf( number, sizeof(number), "%d", widget->value );
+	if( len > widget->width ){
+		memset( text, '*', widget->width );
+		return;
+	}
+
+	memset( text, ' ', widget->width - len );
+	memcpy( text + widget->width - len, number, len );
+}
+
+/*
+ * description:		define, redefine or remove a widget.
+ *
+ * @param def		the widget definition. A width of 0 removes the widget.
+ * @param priority	priority of the update that draws the widget
+ *
+ * @return		0 on success, -EINVAL for a bad definition, or -ENOSPC if there is not enough CGRAM
+*/
+static int lcd_widget_define(struct klcd_device *lcd, const struct klcd_widget_def *def, unsigned int priority)
+{
+	struct klcd_widget *widget;
+	char text[LCD_MAX_COLUMNS];
+	int ret = 0;
+
+	if( def->id >= KLCD_MAX_WIDGETS )
+		return -EINVAL;
+	if( def->width > 0 && ( def->lineNumber < 1 || def->lineNumber > lcd->rows ||
+				def->width > lcd->columns || def->nthCharacter > lcd->columns - def->width ||
+				(def->type != KLCD_WIDGET_BARGRAPH && def->type != KLCD_WIDGET_NUMBER) ||
+				(def->type == KLCD_WIDGET_BARGRAPH && def->min >= def->max) ) )
+		return -EINVAL;
+
+	widget = &lcd->widgets[def->id];
+
+	mutex_lock( &lcd->widget_lock );
+
+	if( widget->width > 0 && widget->type == KLCD_WIDGET_BARGRAPH )
+		lcd_bar_glyphs_put( lcd );
+
+	widget->width = 0;
+	if( def->width == 0 )
+		goto out;
+
+	if( def->type == KLCD_WIDGET_BARGRAPH ){
+		ret = lcd_bar_glyphs_get( lcd );
+		if( ret < 0 )
+			goto out;
+	}
+
+	widget->type  = def->type;
+	widget->cell  = (def->lineNumber - 1) * lcd->columns + def->nthCharacter;
+	widget->width = def->width;
+	widget->min   = def->min;
+	widget->max   = def->max;
+	widget->value = def->value;
+
+	lcd_widget_render( lcd, widget, text );
+	lcd_queue_text( lcd, widget->cell, text, widget->width, priority );
+
+out:
+	mutex_unlock( &lcd->widget_lock );
+	return ret;
+}
+
+/*
+ * description:		set a new value for a widget and redraw the cells that change.
+ *
+ * @return		0 on success, or -EINVAL if the widget is not defined
+*/
+static int lcd_widget_set(struct klcd_device *lcd, const struct klcd_widget_value *value, unsigned int priority)
+{
+	struct klcd_widget *widget;
+	char text[LCD_MAX_COLUMNS];
+
+	if( value->id >= KLCD_MAX_WIDGETS )
+		return -EINVAL;
+
+	widget = &lcd->widgets[value->id];
+
+	mutex_lock( &lcd->widget_lock );
+
+	if( widget->width == 0 ){
+		mutex_unlock( &lcd->widget_lock );
+		return -EINVAL;
+	}
+
+	widget->value = value->value;
+	lcd_widget_render( lcd, widget, text );
+	lcd_queue_text( lcd, widget->cell, text, widget->width, priority );	// in the order the values were set
+
+	mutex_unlock( &lcd->widget_lock );
+	return 0;
+}
+
+// ************* Playlists ***********************************************************************
+
+/* An animation (a spinner, a blinking alert, a rotating icon) is uploaded once with IOCTL_PLAY as a
+   playlist of frames. Each frame replaces a range of cells and can change the bitmap of one of the
+   playlist's own CGRAM glyphs, at a time given from the start of the pass. The passes repeat every
+   period_ms, loops times or forever, until another playlist replaces it or an empty one cancels it.
+
+   An hrtimer fires at the time of the next frame and wakes the bus thread, which applies the frames
+   that are due after the queued updates, so alerts still go first. Frame times are counted from the
+   start of the pass, so a late frame does not delay the ones after it, and a bus thread that fell
+   behind skips to the frame due now instead of playing the missed ones back.
+
+   Character codes 0x00-0x0F in a frame refer to the playlist's glyphs (code % 8), which are pinned in
+   CGRAM for as long as the playlist is loaded.
+*/
+
+/*
+ * description:		the hrtimer: hand the frame over to the bus thread, which may sleep on the bus.
+*/
+static enum hrtimer_restart lcd_play_timer_fn(struct hrtimer *timer)
+{
+	struct klcd_device *lcd = container_of( timer, struct klcd_device, play_timer );
+
+	lcd->play_due = true;
+	wake_up( &lcd->bus_wait );
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * description:		check whether a playlist frame is waiting for the bus thread.
+*/
+static bool lcd_play_pending(struct klcd_device *lcd)
+{
+	return lcd->play_due;
+}
+
+/*
+ * description:		time at which the next frame is due.
+*/
+static ktime_t lcd_play_time(struct klcd_device *lcd)
+{
+	u64 ms = (u64) lcd->play.pass * lcd->play.period_ms + lcd->play.frames[lcd->play.next].at_ms;
+
+	return ktime_add_ns( lcd->play.start, ms * NSEC_PER_MSEC );
+}
+
+/*
+ * description:		stop and unload the playlist. The cells keep showing its last frame. Called with lcd->play_lock held.
+*/
+static void lcd_play_unload(struct klcd_device *lcd)
+{
+	unsigned int i;
+
+	if( lcd->play.frames == NULL )
+		return;
+
+	hrtimer_cancel( &lcd->play_timer );
+	lcd->play_due = false;
+
+	mutex_lock( &lcd->cgram_lock );
+	for( i = 0; i < KLCD_PLAYLIST_GLYPHS; i++ )
+	{
+		if( lcd->play.glyphs & (1 << i) )
+			lcd_cgram_unpin( lcd, LCD_PLAY_CODEPOINT(i) );
+	}
+	mutex_unlock( &lcd->cgram_lock );
+
+	kfree( lcd->play.frames );
+	lcd->play.frames = NULL;
+}
+
+/*
+ * description:		check a playlist and find the glyphs it uses.
+ *
+ * @param first		set to the first frame defining each glyph
+ * @return		the glyphs used (bit n for glyph n), or -EINVAL
+*/
+static int lcd_play_check(struct klcd_device *lcd, const struct klcd_playlist *list, const struct klcd_frame *frames, int *first)
+{
+	unsigned int referenced = 0;
+	unsigned int defined = 0;
+	unsigned int i;
+	unsigned int j;
+
+	if( list->loops != 1 && list->period_ms == 0 )
+		return -EINVAL;
+
+	for( i = 0; i < list->count; i++ )
+	{
+		const struct klcd_frame *frame = &frames[i];
+
+		if( i > 0 && frame->at_ms < frames[i-1].at_ms )
+			return -EINVAL;
+		if( list->loops != 1 && frame->at_ms >= list->period_ms )
+			return -EINVAL;
+		if( frame->cell >= lcd->cells || frame->count > lcd->cells - frame->cell || frame->count > sizeof(frame->text) )
+			return -EINVAL;
+
+		if( frame->glyph >= KLCD_PLAYLIST_GLYPHS || frame->glyph < -1 )
+			return -EINVAL;
+		if( frame->glyph >= 0 && !(defined & (1 << frame->glyph)) ){
+			defined |= 1 << frame->glyph;
+			first[frame->glyph] = i;
+		}
+
+		for( j = 0; j < frame->count; j++ )
+		{
+			if( (unsigned char) frame->text[j] < 2 * LCD_CGRAM_GLYPHS )
+				referenced |= 1 << (frame->text[j] % LCD_CGRAM_GLYPHS);
+		}
+	}
+
+	if( referenced & ~defined )		// a glyph shown but never defined
+		return -EINVAL;
+
+	return defined;
+}
+
+/*
+ * description:		replace the playlist, or cancel it with an empty one.
+ *
+ * @param list		the playlist, with frames pointing to user space
+ * @return		0 on success, -EINVAL for a bad playlist, -ENOSPC if CGRAM has no room for its glyphs
+*/
+static int lcd_play_load(struct klcd_device *lcd, const struct klcd_playlist *list)
+{
+	struct klcd_frame *frames = NULL;
+	char codes[KLCD_PLAYLIST_GLYPHS];
+	int first[KLCD_PLAYLIST_GLYPHS];
+	unsigned int i;
+	unsigned int j;
+	int glyphs = 0;
+	int code;
+
+	if( list->count > KLCD_MAX_FRAMES )
+		return -EINVAL;
+
+	if( list->count > 0 )
+	{
+		frames = kmalloc( list->count * sizeof(*frames), GFP_KERNEL );
+		if( frames == NULL )
+			return -ENOMEM;
+
+		if( copy_from_user( frames, list->frames, list->count * sizeof(*frames) ) ){
+			kfree( frames );
+			return -EFAULT;
+		}
+
+		glyphs = lcd_play_check( lcd, list, frames, first );
+		if( glyphs < 0 ){
+			kfree( frames );
+			return glyphs;
+		}
+	}
+
+	mutex_lock( &lcd->play_lock );
+
+	lcd_play_unload( lcd );
+
+	if( frames == NULL ){
+		mutex_unlock( &lcd->play_lock );
+		return 0;
+	}
+
+	// pin the playlist's glyphs and point its character codes at them
+	mutex_lock( &lcd->cgram_lock );
+	for( i = 0; i < KLCD_PLAYLIST_GLYPHS; i++ )
+	{
+		if( !(glyphs & (1 << i)) )
+			continue;
+
+		code = lcd_cgram_pin( lcd, LCD_PLAY_CODEPOINT(i), frames[first[i]].rows );
+		if( code < 0 ){
+			while( i-- > 0 ){
+				if( glyphs & (1 << i) )
+					lcd_cgram_unpin( lcd, LCD_PLAY_CODEPOINT(i) );
+			}
+			mutex_unlock( &lcd->cgram_lock );
+			mutex_unlock( &lcd->play_lock );
+			kfree( frames );
+			return -ENOSPC;
+		}
+		codes[i] = (char) code;
+	}
+	mutex_unlock( &lcd->cgram_lock );
+
+	for( i = 0; i < list->count; i++ )
+	{
+		for( j = 0; j < frames[i].count; j++ )
+		{
+			if( (unsigned char) frames[i].text[j] < 2 * LCD_CGRAM_GLYPHS )
+				frames[i].text[j] = codes[frames[i].text[j] % LCD_CGRAM_GLYPHS];
+		}
+	}
+
+	lcd->play.frames    = frames;
+	lcd->play.count     = list->count;
+	lcd->play.loops     = list->loops;
+	lcd->play.period_ms = list->period_ms;
+	lcd->play.glyphs    = glyphs;
+	lcd->play.next      = 0;
+	lcd->play.pass      = 0;
+	lcd->play.finished  = false;
+	lcd->play.start     = ktime_get();
+
+	hrtimer_start( &lcd->play_timer, lcd_play_time( lcd ), HRTIMER_MODE_ABS );
+
+	mutex_unlock( &lcd->play_lock );
+	return 0;
+}
+
+/*
+ * description:		jump over the passes that ended while the bus thread was busy, counting their frames as late.
+ *			The frames of the pass before the current one are still gone through, since they decide the
+ *			glyphs and cells the current pass starts from. Called with lcd->play_lock held.
+*/
+static void lcd_play_skip(struct klcd_device *lcd, ktime_t now)
+{
+	s64 elapsed_ns = ktime_to_ns( ktime_sub( now, lcd->play.start ) );
+	u64 pass;
+
+	if( elapsed_ns <= 0 || lcd->play.period_ms == 0 )	// a single pass needs no period
+		return;
+
+	pass = div_u64( div_u64( (u64) elapsed_ns, NSEC_PER_MSEC ), lcd->play.period_ms );
+	if( lcd->play.loops != 0 && pass > lcd->play.loops )
+		pass = lcd->play.loops;
+	if( pass < (u64) lcd->play.pass + 2 )
+		return;
+
+	// every frame from the next one up to the start of pass - 1 is skipped
+	lcd->play.late += (lcd->play.count - lcd->play.next) + (unsigned long) (pass - 2 - lcd->play.pass) * lcd->play.count;
+	lcd->play.pass  = (unsigned int) pass - 1;
+	lcd->play.next  = 0;
+}
+
+/*
+ * description:		bring the cells up to the frames that are due and start the timer for the next one. Called by
+ *			the bus thread.
+ *
+ * detail:		When several frames are due, only the screen after the last of them is sent to the LCD, as
+ *			one update of the cells they change. The frames before it are skipped and counted as late, so
+ *			a bus thread that fell behind catches up at once instead of playing the missed frames back.
+*/
+static void lcd_play_run(struct klcd_device *lcd)
+{
+	const struct klcd_frame *frame;
+	char screen[LCD_MAX_CELLS];
+	unsigned int first = LCD_MAX_CELLS;
+	unsigned int end = 0;
+	unsigned int group = 0, skipped = 0;
+	s64 at_ns, group_ns = 0;
+	ktime_t now;
+
+	if( !lcd->play_due )
+		return;
+
+	mutex_lock( &lcd->play_lock );
+	lcd->play_due = false;
+
+	now = ktime_get();
+
+	if( lcd->play.frames != NULL && !lcd->play.finished )
+	{
+		lcd_play_skip( lcd, now );
+		lcd_shadow_copy( lcd, 0, screen, lcd->cells );
+	}
+
+	while( lcd->play.frames != NULL && !lcd->play.finished && ktime_to_ns( ktime_sub( lcd_play_time( lcd ), now ) ) <= 0 )
+	{
+		frame = &lcd->play.frames[lcd->play.next];
+		at_ns = ktime_to_ns( lcd_play_time( lcd ) );
+
+		// frames with the same time form a group, which is skipped if a later one is due as well
+		if( group == 0 || at_ns != group_ns ){
+			skipped += group;
+			group = 0;
+			group_ns = at_ns;
+		}
+		group++;
+
+		// only the last bitmap of a glyph goes to the LCD, with the cells
+		if( frame->glyph >= 0 ){
+			mutex_lock( &lcd->cgram_lock );
+			lcd_cgram_redefine( lcd, LCD_PLAY_CODEPOINT(frame->glyph), frame->rows );
+			mutex_unlock( &lcd->cgram_lock );
+		}
+
+		memcpy( screen + frame->cell, frame->text, frame->count );
+		first = MIN( first, frame->cell );
+		end   = MAX( end, frame->cell + frame->count );
+
+		if( ++lcd->play.next == lcd->play.count ){
+			lcd->play.next = 0;
+			if( ++lcd->play.pass == lcd->play.loops )
+				lcd->play.finished = true;	// the last frame stays, with its glyphs, until the playlist is replaced
+		}
+
+	}
+
+	// the frames due last are shown together, the ones before them were skipped
+	lcd->play.late += skipped;
+	lcd->play.shown += group;
+	if( group > 0 && ktime_to_ns( now ) - group_ns > LCD_PLAY_LATE_NS )
+		lcd->play.late += group;
+
+	if( end > first ){
+		mutex_lock( &lcd->mutex );
+		lcd_update_cells( lcd, first, screen + first, end - first );	// sends the new bitmaps first
+		mutex_unlock( &lcd->mutex );
+	}
+
+	if( lcd->play.frames != NULL && !lcd->play.finished )
+		hrtimer_start( &lcd->play_timer, lcd_play_time( lcd ), HRTIMER_MODE_ABS );
+
+	mutex_unlock( &lcd->play_lock );
+}
+
+/*
+ * description:		set up the playlist timer.
+*/
+static void lcd_play_init(struct klcd_device *lcd)
+{
+	hrtimer_init( &lcd->play_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS );
+	lcd->play_timer.function = lcd_play_timer_fn;
+}
+
+/*
+ * description:		unload the playlist before the bus thread stops.
+*/
+static void lcd_play_exit(struct klcd_device *lcd)
+{
+	mutex_lock( &lcd->play_lock );
+	lcd_play_unload( lcd );
+	mutex_unlock( &lcd->play_lock );
+}
+
+
+
+// ************* State Snapshot ******************************************************************
+
+/* The whole display state (visible cells, CGRAM glyphs, cursor, address counter and bus timing) can be
+   read from and written to the binary sysfs attribute "state" as a struct klcd_state. Together with
+   keep_display and warm_attach this makes a module reload invisible on the glass:
+
+	cat /sys/class/klcd/klcd/state > /tmp/klcd.state
+	echo 1 > /sys/module/klcd/parameters/keep_display
+	rmmod klcd
+	insmod klcd.ko warm_attach=1
+	cat /tmp/klcd.state > /sys/class/klcd/klcd/state
+
+   A warm attach skips lcd_initialize() and trusts what the panel shows. If the LCD can be read back the
+   cells and CGRAM are read into the shadow buffers; otherwise the cells are marked unknown until they
+   are written, restored from a snapshot, or learned by the scrubber. Restoring a snapshot only sends
+   what differs from the shadow buffers.
+*/
+
+static bool keep_display;
+module_param( keep_display, bool, S_IRUGO | S_IWUSR );
+MODULE_PARM_DESC( keep_display, "leave the display on when the module is unloaded, for a reload with warm_attach=1" );
+
+static bool warm_attach;
+module_param( warm_attach, bool, S_IRUGO );
+MODULE_PARM_DESC( warm_attach, "trust the state of the panel instead of initializing (and clearing) it" );
+
+/*
+ * description:		take over a panel that is already initialized, instead of lcd_initialize().
+*/
+static void lcd_warm_attach(struct klcd_device *lcd)
+{
+	char panel[LCD_MAX_COLUMNS];
+	unsigned int line;
+	unsigned int i;
+
+	mutex_lock( &lcd->mutex );
+
+	write_seqlock( &lcd->shadow_lock );
+	memset( lcd->shadow, ' ', sizeof(lcd->shadow) );
+	bitmap_fill( lcd->shadow_unknown, lcd->cells );
+	write_sequnlock( &lcd->shadow_lock );
+	lcd->address        = LCD_DDRAM_SIZE;	// unknown, so the first update sets an address
+	lcd->address_cgram  = false;
+	lcd->cursor_visible = true;		// cannot be read back, the state lcd_initialize() leaves
+
+	for( line = 0; line < lcd->rows; line++ )
+	{
+		if( lcd_read_cells( lcd, line * lcd->columns, panel, lcd->columns ) < 0 )
+			break;
+
+		write_seqlock( &lcd->shadow_lock );
+		memcpy( lcd->shadow + line * lcd->columns, panel, lcd->columns );
+		bitmap_clear( lcd->shadow_unknown, line * lcd->columns, lcd->columns );
+		write_sequnlock( &lcd->shadow_lock );
+	}
+
+	if( line == lcd->rows )
+	{
+		// the glyphs are kept, but what they stand for is not known any more
+		lcd_command( lcd, 0x40 );
+		if( lcd->transport->read_bytes( lcd, RS_DATA_MODE, (char *) lcd->cgram_shadow, LCD_CGRAM_SIZE ) == 0 )
+		{
+			lcd_shadow_data( lcd, NULL, LCD_CGRAM_SIZE );
+			memcpy( lcd->cgram_rows, lcd->cgram_shadow, LCD_CGRAM_SIZE );
+			for( i = 0; i < LCD_CGRAM_GLYPHS; i++ ){
+				lcd->cgram_slots[i].codepoint = LCD_INVALID_CODEPOINT;
+				lcd->cgram_slots[i].used      = true;
+			}
+		}
+	}
+
+	mutex_unlock( &lcd->mutex );
+}
+
+/*
+ * description:		take a snapshot of the display state.
+*/
+static void lcd_state_save(struct klcd_device *lcd, struct klcd_state *state)
+{
+	unsigned int i;
+
+	memset( state, 0, sizeof(*state) );
+	state->magic   = KLCD_STATE_MAGIC;
+	state->version = KLCD_STATE_VERSION;
+	state->rows    = lcd->rows;
+	state->columns = lcd->columns;
+
+	mutex_lock( &lcd->mutex );
+
+	memcpy( state->cells, lcd->shadow, lcd->cells );
+
+	mutex_lock( &lcd->cgram_lock );
+	memcpy( state->cgram, lcd->cgram_rows, LCD_CGRAM_SIZE );
+	for( i = 0; i < LCD_CGRAM_GLYPHS; i++ )
+		state->glyphs[i] = lcd->cgram_slots[i].used ? lcd->cgram_slots[i].codepoint : LCD_INVALID_CODEPOINT;
+	mutex_unlock( &lcd->cgram_lock );
+
+	state->cursor_visible   = lcd->cursor_visible;
+	state->address          = lcd->address;
+	state->address_cgram    = lcd->address_cgram;
+	state->timing_calibrated = lcd->timing_calibrated;
+	state->nibble_us        = lcd->timing.nibble_us;
+	state->pulse_us         = lcd->timing.pulse_us;
+
+	mutex_unlock( &lcd->mutex );
+}
+
+/*
+ * description:		restore a snapshot, sending only what differs from the shadow buffers.
+ * @return		0 on success, -EINVAL for a bad snapshot, or -EBUSY while bargraphs or a playlist hold CGRAM glyphs
+*/
+static int lcd_state_restore(struct klcd_device *lcd, const struct klcd_state *state)
+{
+	unsigned int i;
+
+	if( state->magic != KLCD_STATE_MAGIC || state->version != KLCD_STATE_VERSION )
+		return -EINVAL;
+	if( state->rows != lcd->rows || state->columns != lcd->columns )
+		return -EINVAL;
+	if( state->address_cgram ? state->address >= LCD_CGRAM_SIZE : state->address >= LCD_DDRAM_SIZE )
+		return -EINVAL;
+
+	mutex_lock( &lcd->mutex );
+	mutex_lock( &lcd->cgram_lock );
+
+	for( i = 0; i < LCD_CGRAM_GLYPHS; i++ )
+	{
+		if( lcd->cgram_slots[i].pinned ){	// held by a bargraph or a playlist
+			mutex_unlock( &lcd->cgram_lock );
+			mutex_unlock( &lcd->mutex );
+			return -EBUSY;
+		}
+	}
+
+	if( state->timing_calibrated ){		// a snapshot is not trusted to keep the timing in range
+		lcd->timing.nibble_us  = state->nibble_us;
+		lcd->timing.pulse_us   = state->pulse_us;
+		lcd_timing_clamp( &lcd->timing );
+		lcd->timing_calibrated = true;
+	}
+
+	for( i = 0; i < LCD_CGRAM_GLYPHS; i++ )
+	{
+		lcd->cgram_slots[i].codepoint = state->glyphs[i];
+		lcd->cgram_slots[i].used      = state->glyphs[i] != LCD_INVALID_CODEPOINT;
+		lcd->cgram_slots[i].pinned    = 0;
+
+		if( !memcmp( lcd->cgram_rows + i * 8, state->cgram + i * 8, 8 ) )
+			continue;
+
+		memcpy( lcd->cgram_rows + i * 8, state->cgram + i * 8, 8 );
+		lcd->cgram_dirty |= 1 << i;
+	}
+
+	mutex_unlock( &lcd->cgram_lock );
+
+	lcd_update_cells( lcd, 0, (const char *) state->cells, lcd->cells );	// sends the glyphs first
+
+	if( state->cursor_visible != lcd->cursor_visible ){
+		if( state->cursor_visible )
+			lcd_cursor_on( lcd );
+		else
+			lcd_cursor_off( lcd );
+	}
+
+	// put the address counter (and with it the cursor) back
+	if( state->address_cgram != lcd->address_cgram || state->address != lcd->address )
+		lcd_command( lcd, (state->address_cgram ? 0x40 : 0x80) | state->address );
+
+	mutex_unlock( &lcd->mutex );
+
+	return 0;
+}
+
+
+
+// ************* Terminal ************************************************************************
+
+/* In terminal mode (the default, see IOCTL_SET_MODE and default_mode) write() only appends to a ring
+   buffer and returns, so there is no limit on the length of a write. The bus thread drains the ring
+   between queued updates: text goes onto the bottom line, '\n' scrolls the screen up by a line and text
+   longer than a line wraps. Like the wrap, the scroll of a '\n' waits for the next printable character,
+   so a line that ends in '\n' stays on the bottom line instead of leaving it empty. A scroll shifts a copy of the shadow buffer and is then applied through
+   lcd_update_cells(), so only the cells whose character actually changes are sent to the LCD.
+
+   A writer blocks while the ring is full and resumes once the bus thread has drained it below
+   LCD_TERM_LOW_WATER; with O_NONBLOCK it gets -EAGAIN instead, and poll() reports the device as
+   writable by the same fill level.
+*/
+
+static char *default_mode = "terminal";
+module_param( default_mode, charp, S_IRUGO );
+MODULE_PARM_DESC( default_mode, "behaviour of write() on a newly opened file, \"terminal\" (default), \"cells\" or \"legacy\"" );
+
+/*
+ * description:		check whether terminal text is waiting for the bus thread.
+*/
+static bool lcd_term_pending(struct klcd_device *lcd)
+{
+	return !kfifo_is_empty( &lcd->term_fifo );
+}
+
+/*
+ * description:		check whether a blocked writer may continue.
+*/
+static bool lcd_term_writable(struct klcd_device *lcd)
+{
+	return kfifo_len( &lcd->term_fifo ) < LCD_TERM_LOW_WATER;
+}
+
+/*
+ * description:		scroll a copy of the screen up by a line and return to the start of the bottom line.
+ * @param screen	lcd->cells character codes
+*/
+static void lcd_term_newline(struct klcd_device *lcd, char *screen)
+{
+	memmove( screen, screen + lcd->columns, lcd->cells - lcd->columns );
+	memset( screen + lcd->cells - lcd->columns, ' ', lcd->columns );
+
+	lcd->term_column  = 0;
+	lcd->term_newline = false;
+}
+
+/*
+ * description:		put one character code at the terminal cursor, first scrolling for a pending '\n' or
+ *			wrapping to a new line when the bottom line is full.
+*/
+static void lcd_term_putc(struct klcd_device *lcd, char *screen, char code)
+{
+	if( lcd->term_newline || lcd->term_column >= lcd->columns )
+		lcd_term_newline( lcd, screen );
+
+	screen[lcd->cells - lcd->columns + lcd->term_column++] = code;
+}
+
+/*
+ * description:		apply a chunk of UTF-8 text from the ring to the LCD. Called by the bus thread with lcd->mutex held.
+ *
+ * @param text		bytes taken from the ring
+ * @param len		the number of bytes, at most LCD_TERM_CHUNK
+*/
+static void lcd_term_feed(struct klcd_device *lcd, const char *text, unsigned int len)
+{
+	char buf[sizeof(lcd->term_partial) + LCD_TERM_CHUNK];
+	char screen[LCD_MAX_CELLS];
+	unsigned int claimed = 0;
+	unsigned int in = 0;
+	unsigned int used;
+	u32 codepoint;
+	u16 code;
+	int glyph;
+
+	memcpy( buf, lcd->term_partial, lcd->term_partial_len );
+	memcpy( buf + lcd->term_partial_len, text, len );
+	len += lcd->term_partial_len;
+	lcd->term_partial_len = 0;
+
+	memcpy( screen, lcd->shadow, lcd->cells );
+
+	while( in < len )
+	{
+		used = lcd_utf8_decode( buf + in, len - in, &codepoint );
+		if( used == 0 ){			// finish the sequence with the next chunk
+			lcd->term_partial_len = len - in;
+			memcpy( lcd->term_partial, buf + in, lcd->term_partial_len );
+			break;
+		}
+		in += used;
+
+		switch( codepoint ){
+			case '\n':
+				if( lcd->term_newline )		// an empty line scrolls the previous one up now
+					lcd_term_newline( lcd, screen );
+				lcd->term_newline = true;
+				continue;
+			case '\r':
+				lcd->term_column = 0;
+				continue;
+			case '\b':
+				if( lcd->term_column > 0 )
+					lcd->term_column--;
+				continue;
+			case '\t':
+				codepoint = ' ';
+				break;
+		}
+
+		if( codepoint < 0x20 || codepoint == 0x7F )	// other control characters (including '\0') are ignored
+			continue;
+
+		code = lcd_rom_lookup( codepoint );
+		if( code != 0 ){
+			lcd_term_putc( lcd, screen, (char) (code & 0xFF) );
+			if( code >> 8 )
+				lcd_term_putc( lcd, screen, (char) (code >> 8) );
+			continue;
+		}
+
+		mutex_lock( &lcd->cgram_lock );
+		glyph = lcd_cgram_glyph( lcd, codepoint, &claimed );
+		mutex_unlock( &lcd->cgram_lock );
+		lcd_term_putc( lcd, screen, (glyph < 0) ? LCD_UNKNOWN_CHAR : (char) glyph );
+	}
+
+	lcd_update_cells( lcd, 0, screen, lcd->cells );
+}
+
+/*
+ * description:		drain the ring onto the LCD. Called by the bus thread, returns as soon as an update is queued.
+*/
+static void lcd_term_run(struct klcd_device *lcd)
+{
+	char chunk[LCD_TERM_CHUNK];
+	unsigned int len;
+
+	while( lcd_term_pending( lcd ) )
+	{
+		if( lcd_queue_peek( lcd ) != NULL )		// queued updates go first
+			return;
+
+		len = kfifo_out( &lcd->term_fifo, chunk, sizeof(chunk) );
+
+		if( lcd_term_writable( lcd ) )
+			wake_up_interruptible( &lcd->term_wait );
+
+		mutex_lock( &lcd->mutex );
+		lcd_term_feed( lcd, chunk, len );
+		mutex_unlock( &lcd->mutex );
+	}
+}
+
+/*
+ * description:		append text to the ring, blocking while it is full.
+ *
+ * @param source	the text in user space
+ * @param len		the number of bytes
+ * @param nonblock	return -EAGAIN (or a short count) instead of blocking
+ *
+ * @return		the number of bytes accepted, or a negative error code
+*/
+static ssize_t lcd_term_write(struct klcd_device *lcd, struct klcd_source *source, size_t len, bool nonblock)
+{
+	char chunk[LCD_TERM_CHUNK];
+	size_t written = 0;
+	unsigned int count;
+	ssize_t ret = 0;
+
+	if( nonblock ){
+		if( !mutex_trylock( &lcd->term_lock ) )
+			return -EAGAIN;
+	}
+	else if( mutex_lock_interruptible( &lcd->term_lock ) )
+		return -ERESTARTSYS;
+
+	while( written < len )
+	{
+		// only the bus thread takes bytes out while the lock is held, so the room can only grow
+		if( kfifo_is_full( &lcd->term_fifo ) )
+		{
+			if( nonblock ){
+				ret = -EAGAIN;
+				break;
+			}
+			if( wait_event_interruptible( lcd->term_wait, lcd_term_writable( lcd ) ) ){
+				ret = -ERESTARTSYS;
+				break;
+			}
+		}
+
+		count = MIN( (size_t) kfifo_avail( &lcd->term_fifo ), MIN( len - written, sizeof(chunk) ) );
+
+		if( klcd_source_copy( source, chunk, count ) ){
+			ret = -EFAULT;
+			break;
+		}
+
+		kfifo_in( &lcd->term_fifo, chunk, count );
+		written += count;
+
+		wake_up( &lcd->bus_wait );
+	}
+
+	mutex_unlock( &lcd->term_lock );
+
+	return written ? written : ret;
+}
+
+
+
+// ************* File Operations *****************************************************************
+
+static void klcd_device_release(struct kref *kref)
+{
+	kfree( container_of( kref, struct klcd_device, kref ) );
+}
+
+/*
+ * description:		start a file operation that may use the bus thread.
+ * @return		0, or -ENODEV if the LCD is being removed. On success klcd_leave() must follow.
+*/
+static int klcd_enter(struct klcd_device *lcd)
+{
+	down_read( &lcd->remove_lock );
+	if( lcd->removed ){
+		up_read( &lcd->remove_lock );
+		return -ENODEV;
+	}
+	return 0;
+}
+
+static void klcd_leave(struct klcd_device *lcd)
+{
+	up_read( &lcd->remove_lock );
+}
+
+static int klcd_open(struct inode *p_inode, struct file *p_file )
+{
+	struct klcd_file *klcd_file;
+	struct klcd_device *lcd;
+
+	klcd_file = kzalloc( sizeof(*klcd_file), GFP_KERNEL );
+	if( klcd_file == NULL )
+		return -ENOMEM;
+
+	// the LCD may be on its way out, in which case it is no longer in the table
+	mutex_lock( &klcd_devices_lock );
+	lcd = klcd_devices[ iminor(p_inode) - MINOR_NUM_START ];
+	if( lcd )
+		kref_get( &lcd->kref );
+	mutex_unlock( &klcd_devices_lock );
+
+	if( lcd == NULL ){
+		kfree( klcd_file );
+		return -ENODEV;
+	}
+
+	klcd_file->lcd       = lcd;
+	klcd_file->priority  = KLCD_PRIORITY_NORMAL;
+	if( !strcmp( default_mode, "legacy" ) )
+		klcd_file->mode = KLCD_MODE_LEGACY;
+	else if( !strcmp( default_mode, "cells" ) )
+		klcd_file->mode = KLCD_MODE_CELLS;
+	else
+		klcd_file->mode = KLCD_MODE_TERMINAL;
+	p_file->private_data = klcd_file;
+
+	printk(KERN_INFO "klcd Driver: open()\n");
+	return 0;
+}
+static int klcd_close(struct inode *p_inode, struct file *p_file )
+{
+	struct klcd_file *klcd_file = p_file->private_data;
+
+	kref_put( &klcd_file->lcd->kref, klcd_device_release );	// may be the last reference after a removal
+	kfree( klcd_file );
+
+	printk(KERN_INFO "klcd Driver: close()\n\n");
+	return 0;
+}
+/*
+ * description:		read(): the character codes shown, from the cell at the file position onwards.
+*/
+static ssize_t klcd_read(struct file *p_file, char __user *buf, size_t len, loff_t *off)
+{
+	struct klcd_file *klcd_file = p_file->private_data;
+	struct klcd_device *lcd = klcd_file->lcd;
+	char cells[LCD_MAX_CELLS];
+	size_t count;
+
+	printk(KERN_INFO "klcd Driver: read()\n");
+
+	if( *off < 0 )
+		return -EINVAL;
+	if( *off >= lcd->cells )
+		return 0;
+	count = MIN( len, (size_t) (lcd->cells - *off) );
+
+	lcd_shadow_copy( lcd, *off, cells, count );
+
+	if( copy_to_user( buf, cells, count ) )
+		return -EFAULT;
+
+	*off += count;
+	return count;
+}
+
+/*
+ * description:		llseek(): the file position is a linear cell index, (line - 1) * lcd->columns + nthCharacter.
+*/
+static loff_t klcd_llseek(struct file *p_file, loff_t offset, int whence)
+{
+	struct klcd_file *klcd_file = p_file->private_data;
+	struct klcd_device *lcd = klcd_file->lcd;
+	loff_t pos;
+
+	switch( whence ){
+		case SEEK_SET:
+			pos = offset;
+			break;
+		case SEEK_CUR:
+			pos = p_file->f_pos + offset;
+			break;
+		case SEEK_END:
+			pos = lcd->cells + offset;
+			break;
+		default:
+			return -EINVAL;
+	}
+
+	if( pos < 0 || pos > lcd->cells )
+		return -EINVAL;
+
+	p_file->f_pos = pos;
+	return pos;
+}
+
+/*
+ * description:		copy the next bytes of a write from user space.
+ * @return		0 on success, -EFAULT if the user space buffer is invalid
+*/
+static int klcd_source_copy(struct klcd_source *source, char *kbuf, size_t count)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,16,0)
+	return ( copy_from_iter( kbuf, count, source->iter ) == count ) ? 0 : -EFAULT;
+#else
+	if( copy_from_user( kbuf, source->buf, count ) )
+		return -EFAULT;
+
+	source->buf += count;
+	return 0;
+#endif
+}
+
+/*
+ * description:		legacy write(): replace the screen with the first MAX_BUF_LENGTH - 1 bytes, less the last one.
+*/
+static ssize_t klcd_write_legacy(struct klcd_file *klcd_file, struct klcd_source *source, size_t len)
+{
+	struct klcd_device *lcd = klcd_file->lcd;
+	char kbuf[MAX_BUF_LENGTH];
+	char screen[LCD_MAX_CELLS];
+	unsigned long copyLength;
+	unsigned int count;
+
+	memset( kbuf, '\0', sizeof(char) * MAX_BUF_LENGTH );
+	copyLength = (len > 0) ? MIN( (MAX_BUF_LENGTH-1), (unsigned long) (len-1) ) : 0;
+
+	// Copy user space buffer to kernel space buffer
+	if( klcd_source_copy( source, kbuf, copyLength ) ){
+		printk( KERN_DEBUG "ERR: Failed to copy from user space buffer \n" );
+		return -EFAULT;
+	}
+
+	//printk( KERN_INFO "***** value copied from user space:  %s *****\n", kbuf );
+	//printk( KERN_INFO "***** copyLength:  %lu *****\n", copyLength );
+	
+	// convert UTF-8 to the character codes of the LCD controller
+	lcd_translate_begin( lcd );
+	lcd_translate( lcd, kbuf );
+
+	/* clear display and print on the first line by default, continuing on the second line. Both are
+	   done as a single update of the whole screen, so only the cells that change are sent.
+	*/
+	count = strnlen( kbuf, lcd->cells );
+	memcpy( screen, kbuf, count );
+	memset( screen + count, ' ', lcd->cells - count );
+
+	lcd_queue_text( lcd, 0, screen, lcd->cells, klcd_file->priority );
+	lcd_translate_end( lcd );
+
+	return len;
+}
+
+/*
+ * description:		cells write(): replace the cells from the file position onwards, nothing else on the screen changes.
+ *
+ * @param off		file position, the first cell. It is advanced by the number of cells written.
+ * @return		the number of bytes used (UTF-8 may take several bytes per cell), or a negative error code
+ *
+ * detail:		Text that does not fit before the end of the screen is dropped, but counted as written.
+ *			A '\0' ends the text.
+*/
+static ssize_t klcd_write_cells(struct klcd_file *klcd_file, struct klcd_source *source, size_t len, loff_t *off)
+{
+	struct klcd_device *lcd = klcd_file->lcd;
+	char kbuf[LCD_TEXT_BUF_LENGTH];
+	unsigned int count;
+
+	if( *off < 0 )
+		return -EINVAL;
+	if( *off >= lcd->cells )
+		return len ? -ENOSPC : 0;
+
+	if( len > LCD_TEXT_BUF_LENGTH - 1 ){
+		len = LCD_TEXT_BUF_LENGTH - 1;
+		if( klcd_source_copy( source, kbuf, len ) )
+			return -EFAULT;
+		len = lcd_utf8_complete( kbuf, len );	// the rest of the sequence comes with the caller's next write
+	}
+	else if( klcd_source_copy( source, kbuf, len ) )
+		return -EFAULT;
+	kbuf[len] = '\0';
+
+	lcd_translate_begin( lcd );
+	lcd_translate( lcd, kbuf );
+
+	count = strnlen( kbuf, lcd->cells - *off );
+	lcd_queue_text( lcd, *off, kbuf, count, klcd_file->priority );
+	lcd_translate_end( lcd );
+
+	*off += count;
+	return len;
+}
+
+/*
+ * description:		common part of write() and write_iter(), once the LCD is known to stay.
+ * @param off		file position, only used in KLCD_MODE_CELLS. In terminal mode the text always goes
+ *			to the terminal cursor, so a write at any other position than 0 fails with -ESPIPE
+ *			instead of quietly ignoring the position.
+*/
+static ssize_t klcd_write_mode(struct file *p_file, struct klcd_source *source, size_t len, loff_t *off)
+{
+	struct klcd_file *klcd_file = p_file->private_data;
+
+	if( klcd_file->mode == KLCD_MODE_LEGACY )
+		return klcd_write_legacy( klcd_file, source, len );
+
+	if( klcd_file->mode == KLCD_MODE_CELLS )
+		return klcd_write_cells( klcd_file, source, len, off );
+
+	if( *off != 0 )			// pwrite() or dd seek=, which need KLCD_MODE_CELLS
+		return -ESPIPE;
+
+	return lcd_term_write( klcd_file->lcd, source, len, p_file->f_flags & O_NONBLOCK );
+}
+
+/*
+ * description:		common part of write() and write_iter().
+*/
+static ssize_t klcd_write_source(struct file *p_file, struct klcd_source *source, size_t len, loff_t *off)
+{
+	struct klcd_file *klcd_file = p_file->private_data;
+	ssize_t ret;
+
+	printk(KERN_INFO "klcd Driver: write()\n");
+
+	if( klcd_enter( klcd_file->lcd ) )
+		return -ENODEV;
+	ret = klcd_write_mode( p_file, source, len, off );
+	klcd_leave( klcd_file->lcd );
+
+	return ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,16,0)
+/*
+ * description:		write(), pwrite(), writev(), pwritev() and splice() into the device.
+*/
+static ssize_t klcd_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct klcd_source source = { .iter = from };
+
+	return klcd_write_source( iocb->ki_filp, &source, iov_iter_count(from), &iocb->ki_pos );
+}
+#else
+static ssize_t klcd_write(struct file *p_file, const char __user *buf, size_t len, loff_t *off)
+{
+	struct klcd_source source = { .buf = buf };
+
+	if( buf == NULL){
+		printk( KERN_DEBUG "ERR: Empty user space buffer \n" );
+		return -ENOMEM;
+	}
+
+	return klcd_write_source( p_file, &source, len, off );
+}
+#endif
+
+/*
+ * description:		poll(): the device is writable while the terminal ring is below LCD_TERM_LOW_WATER.
+*/
+static unsigned int klcd_poll(struct file *p_file, poll_table *wait)
+{
+	struct klcd_file *klcd_file = p_file->private_data;
+	struct klcd_device *lcd = klcd_file->lcd;
+
+	if( lcd->removed )
+		return POLLERR | POLLHUP;
+
+	if( klcd_file->mode != KLCD_MODE_TERMINAL )
+		return POLLOUT | POLLWRNORM;
+
+	poll_wait( p_file, &lcd->term_wait, wait );
+
+	return lcd_term_writable( lcd ) ? (POLLOUT | POLLWRNORM) : 0;
+}
+
+/*
+ * description:		fsync(): wait until everything written so far, through any file of the LCD, is shown.
+ *			write() and ioctl() only queue their updates and return.
+*/
+static int klcd_fsync(struct file *p_file, loff_t start, loff_t end, int datasync)
+{
+	struct klcd_file *klcd_file = p_file->private_data;
+	struct klcd_device *lcd = klcd_file->lcd;
+	int ret = 0;
+
+	if( klcd_enter( lcd ) )
+		return -ENODEV;
+
+	// the bus thread finishes the last chunk of terminal text before it looks at the queue again
+	if( wait_event_interruptible( lcd->term_wait, !lcd_term_pending( lcd ) ) )
+		ret = -ERESTARTSYS;
+	else
+		lcd_queue_flush( lcd );
+
+	klcd_leave( lcd );
+	return ret;
+}
+
+static long klcd_ioctl_command( struct file *p_file, unsigned int ioctl_command, unsigned long arg)
+{
+	struct klcd_file *klcd_file = p_file->private_data;
+	struct klcd_device *lcd = klcd_file->lcd;
+	struct ioctl_mesg ioctl_arguments;
+	struct klcd_widget_def widget_def;
+	struct klcd_widget_value widget_value;
+	struct klcd_playlist playlist;
+	unsigned int priority;
+	unsigned int mode;
+	long ret = 0;
+
+	printk(KERN_INFO "klcd Driver: ioctl\n");
+      	
+	if( ((const void *)arg) == NULL){
+		printk( KERN_DEBUG "ERR: Invalid argument for klcd IOCTL \n");
+		return -EINVAL;
+	}
+
+	// commands that do not take a struct ioctl_mesg
+	switch( (char) ioctl_command ){
+		case IOCTL_SET_PRIORITY:
+			if( copy_from_user( &priority, (const void *)arg, sizeof(priority) ) )
+				return -EFAULT;
+			if( priority >= LCD_NUM_PRIORITIES )
+				return -EINVAL;
+
+			klcd_file->priority = priority;
+			return 0;
+
+		case IOCTL_SET_MODE:
+			if( copy_from_user( &mode, (const void *)arg, sizeof(mode) ) )
+				return -EFAULT;
+			if( mode != KLCD_MODE_LEGACY && mode != KLCD_MODE_TERMINAL && mode != KLCD_MODE_CELLS )
+				return -EINVAL;
+
+			klcd_file->mode = mode;
+			return 0;
+
+		case IOCTL_DEFINE_WIDGET:
+			if( copy_from_user( &widget_def, (const void *)arg, sizeof(widget_def) ) )
+				return -EFAULT;
+
+			return lcd_widget_define( lcd, &widget_def, klcd_file->priority );
+
+		case IOCTL_SET_WIDGET:
+			if( copy_from_user( &widget_value, (const void *)arg, sizeof(widget_value) ) )
+				return -EFAULT;
+
+			return lcd_widget_set( lcd, &widget_value, klcd_file->priority );
+
+		case IOCTL_PLAY:
+			if( copy_from_user( &playlist, (const void *)arg, sizeof(playlist) ) )
+				return -EFAULT;
+
+			return lcd_play_load( lcd, &playlist );
+	}
+
+	memset( ioctl_arguments.kbuf, '\0', sizeof(char) * MAX_BUF_LENGTH );
+
+	// copy ioctl command argument from user space
+	if( copy_from_user( &ioctl_arguments, (const void *)arg, sizeof(ioctl_arguments) ) ){
+		printk( KERN_DEBUG "ERR: Failed to copy from user space buffer \n" );
+		return -EFAULT;
+	}
+
+	ioctl_arguments.kbuf[MAX_BUF_LENGTH-1] = '\0';
+
+	switch( (char) ioctl_command ){
+		case IOCTL_CLEAR_DISPLAY:
+			lcd_queue_command( lcd, lcd_clearDisplay, klcd_file->priority );
+			break;
+
+		case IOCTL_PRINT_ON_FIRSTLINE:
+			lcd_translate_begin( lcd );
+			lcd_translate( lcd, ioctl_arguments.kbuf );
+			lcd_print( lcd, ioctl_arguments.kbuf, LCD_FIRST_LINE, klcd_file->priority );
+			lcd_translate_end( lcd );
+			break;
+
+		case IOCTL_PRINT_ON_SECONDLINE:
+			lcd_translate_begin( lcd );
+			lcd_translate( lcd, ioctl_arguments.kbuf );
+			lcd_print( lcd, ioctl_arguments.kbuf, LCD_SECOND_LINE, klcd_file->priority );
+			lcd_translate_end( lcd );
+			break;
+
+		case IOCTL_PRINT_WITH_POSITION:
+			lcd_translate_begin( lcd );
+			lcd_translate( lcd, ioctl_arguments.kbuf );
+			lcd_print_WithPosition( lcd, ioctl_arguments.kbuf, ioctl_arguments.lineNumber, ioctl_arguments.nthCharacter, klcd_file->priority );
+			lcd_translate_end( lcd );
+			break;
+
+		case IOCTL_CURSOR_ON:
+			lcd_queue_command( lcd, lcd_cursor_on, klcd_file->priority );
+			break;
+
+		case IOCTL_CURSOR_OFF:
+			lcd_queue_command( lcd, lcd_cursor_off, klcd_file->priority );
+			break;
+
+		default:
+			printk(KERN_DEBUG "klcd Driver (ioctl): No such command \n");
+			ret = -ENOTTY;
+			break;
+	}
+
+	return ret;
+}
+
+static long klcd_ioctl( struct file *p_file, unsigned int ioctl_command, unsigned long arg)
+{
+	struct klcd_file *klcd_file = p_file->private_data;
+	long ret;
+
+	if( klcd_enter( klcd_file->lcd ) )
+		return -ENODEV;
+	ret = klcd_ioctl_command( p_file, ioctl_command, arg );
+	klcd_leave( klcd_file->lcd );
+
+	return ret;
+}
+
+// ************* Sysfs Attributes ****************************************************************
+
+/* Attributes of each klcd class device (/sys/class/klcd/klcd/, /sys/class/klcd/klcd1/, ...):
+ *
+ *	line1 - line4	the text of one line. Writing replaces the whole line (padded with spaces).
+ *			Only the lines the LCD has are shown.
+ *	contents	all lines, each followed by a newline. Writing replaces the whole screen.
+ *	cursor		"on" or "off"
+ *	scrub_interval	time between two scrubber passes in ms, 0 if stopped
+ *	scrub_cells	cells checked by each scrubber pass
+ *	scrub_repaired	the number of corrupted cells found and rewritten by the scrubber
+ *	bus_timing	how much longer than nominal the GPIO nibble transfers took (average and worst)
+ *	deadline_misses	per priority: updates applied, updates shown later than deadline_ms, worst latency
+ *	timing		the bus timing in use, and whether it was found by a calibration
+ *	planner		how often the cursor movement planner chose each way of reaching the next cell
+ *	playlist	state of the playlist (none, playing or finished), frames shown, and late
+ *			(shown after their time, or skipped because the bus thread fell behind)
+ *	calibrate	writing 1 calibrates the bus timing (needs rw_wired=1) and returns once it is done
+ *	state		(binary) a struct klcd_state snapshot of the display. Writing one restores it.
+ *
+ * Writes go through lcd_update_cells(), so only the cells that change are sent to the LCD, and return
+ * once the LCD shows them.
+*/
+
+/*
+ * description:		translate a line of UTF-8 text into one line of cells, padded with spaces.
+ *
+ * @param cells		lcd->columns character codes for the line
+ * @param text		UTF-8 text, which does not need to be '\0' terminated
+ * @param len		length of text in bytes. A trailing newline is ignored.
+ *
+ * detail:		Called between lcd_translate_begin() and lcd_translate_end().
+*/
+static void klcd_sysfs_line_cells(struct klcd_device *lcd, char *cells, const char *text, size_t len)
+{
+	char kbuf[LCD_TEXT_BUF_LENGTH];
+	unsigned int count;
+
+	if( len > 0 && text[len-1] == '\n' )
+		len--;
+	len = MIN( len, (size_t) (LCD_TEXT_BUF_LENGTH - 1) );
+
+	memcpy( kbuf, text, len );
+	kbuf[len] = '\0';
+
+	lcd_translate( lcd, kbuf );
+
+	count = strnlen( kbuf, lcd->columns );
+	memcpy( cells, kbuf, count );
+	memset( cells + count, ' ', lcd->columns - count );
+}
+
+static ssize_t klcd_line_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t klcd_line_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+
+static DEVICE_ATTR(line1, S_IRUGO | S_IWUSR, klcd_line_show, klcd_line_store);
+static DEVICE_ATTR(line2, S_IRUGO | S_IWUSR, klcd_line_show, klcd_line_store);
+static DEVICE_ATTR(line3, S_IRUGO | S_IWUSR, klcd_line_show, klcd_line_store);
+static DEVICE_ATTR(line4, S_IRUGO | S_IWUSR, klcd_line_show, klcd_line_store);
+
+static struct device_attribute *klcd_line_attributes[LCD_MAX_LINES] = {
+	&dev_attr_line1,
+	&dev_attr_line2,
+	&dev_attr_line3,
+	&dev_attr_line4,
+};
+
+/*
+ * description:		the line (counted from 0) a lineN attribute stands for.
+*/
+static unsigned int klcd_line_of(struct device_attribute *attr)
+{
+	unsigned int line;
+
+	for( line = 0; line < LCD_MAX_LINES - 1; line++ )
+		if( klcd_line_attributes[line] == attr )
+			break;
+
+	return line;
+}
+
+static ssize_t klcd_line_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct klcd_device *lcd = dev_get_drvdata( dev );
+	unsigned int line = klcd_line_of( attr );
+
+	lcd_shadow_copy( lcd, line * lcd->columns, buf, lcd->columns );
+
+	buf[lcd->columns] = '\n';
+	return lcd->columns + 1;
+}
+
+static ssize_t klcd_line_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct klcd_device *lcd = dev_get_drvdata( dev );
+	unsigned int line = klcd_line_of( attr );
+	char cells[LCD_MAX_COLUMNS];
+
+	lcd_translate_begin( lcd );
+	klcd_sysfs_line_cells( lcd, cells, buf, count );
+	lcd_queue_text( lcd, line * lcd->columns, cells, lcd->columns, KLCD_PRIORITY_NORMAL );
+	lcd_translate_end( lcd );
+	lcd_queue_flush( lcd );
+
+	return count;
+}
+
+static ssize_t klcd_contents_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct klcd_device *lcd = dev_get_drvdata( dev );
+	char screen[LCD_MAX_CELLS];
+	unsigned int line;
+
+	lcd_shadow_copy( lcd, 0, screen, lcd->cells );
+
+	for( line = 0; line < lcd->rows; line++ )
+	{
+		memcpy( buf + line * (lcd->columns + 1), screen + line * lcd->columns, lcd->columns );
+		buf[line * (lcd->columns + 1) + lcd->columns] = '\n';
+	}
+	return lcd->rows * (lcd->columns + 1);
+}
+
+static ssize_t klcd_contents_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct klcd_device *lcd = dev_get_drvdata( dev );
+	const char *text = buf;
+	const char *end  = buf + count;
+	const char *newline;
+	char cells[LCD_MAX_CELLS];
+	unsigned int line;
+
+	// one line of text per line of the LCD, missing lines are cleared
+	lcd_translate_begin( lcd );
+	for( line = 0; line < lcd->rows; line++ )
+	{
+		newline = memchr( text, '\n', end - text );
+		klcd_sysfs_line_cells( lcd, cells + line * lcd->columns, text, (newline ? newline : end) - text );
+		text = newline ? newline + 1 : end;
+	}
+
+	lcd_queue_text( lcd, 0, cells, lcd->cells, KLCD_PRIORITY_NORMAL );
+	lcd_translate_end( lcd );
+	lcd_queue_flush( lcd );
+
+	return count;
+}
+
+static ssize_t klcd_geometry_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct klcd_device *lcd = dev_get_drvdata( dev );
+
+	return sprintf( buf, "%ux%u\n", lcd->columns, lcd->rows );
+}
+
+static ssize_t klcd_cursor_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct klcd_device *lcd = dev_get_drvdata( dev );
+
+	return sprintf( buf, "%s\n", lcd->cursor_visible ? "on" : "off" );
+}
+
+static ssize_t klcd_cursor_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct klcd_device *lcd = dev_get_drvdata( dev );
+	bool on;
+
+	if( sysfs_streq( buf, "on" ) || sysfs_streq( buf, "1" ) )
+		on = true;
+	else if( sysfs_streq( buf, "off" ) || sysfs_streq( buf, "0" ) )
+		on = false;
+	else
+		return -EINVAL;
+
+	if( on != lcd->cursor_visible )
+		lcd_queue_command_wait( lcd, on ? lcd_cursor_on : lcd_cursor_off, KLCD_PRIORITY_NORMAL );
+
+	return count;
+}
+
+static ssize_t klcd_scrub_interval_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct klcd_device *lcd = dev_get_drvdata( dev );
+
+	return sprintf( buf, "%u\n", lcd->scrub_interval );
+}
+
+static ssize_t klcd_scrub_interval_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct klcd_device *lcd = dev_get_drvdata( dev );
+	unsigned int interval;
+
+	if( kstrtouint( buf, 10, &interval ) < 0 )
+		return -EINVAL;
+
+	lcd_scrub_set_interval( lcd, interval );
+	return count;
+}
+
+static ssize_t klcd_scrub_cells_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct klcd_device *lcd = dev_get_drvdata( dev );
+
+	return sprintf( buf, "%u\n", lcd->scrub_cells );
+}
+
+static ssize_t klcd_scrub_cells_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct klcd_device *lcd = dev_get_drvdata( dev );
+	unsigned int cells;
+
+	if( kstrtouint( buf, 10, &cells ) < 0 || cells == 0 || cells > lcd->columns )
+		return -EINVAL;
+
+	lcd->scrub_cells = cells;
+	return count;
+}
+
+static ssize_t klcd_scrub_repaired_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	printk(KERN_INFO "klcd Driver: close()\n\n");
-	return 0;
+	struct klcd_device *lcd = dev_get_drvdata( dev );
+
+	return sprintf( buf, "%lu\n", lcd->scrub_repaired );
 }
-static ssize_t klcd_read(struct file *p_file, char __user *buf, size_t len, loff_t *off)
+
+static ssize_t klcd_bus_timing_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	printk(KERN_INFO "klcd Driver: read()\n");
-	return 0;
+	struct klcd_device *lcd = dev_get_drvdata( dev );
+	u64 nibbles = lcd->bus_stats.nibbles;
+
+	return sprintf( buf, "nibbles %llu deviation_avg_ns %llu deviation_max_ns %llu\n",
+			nibbles, nibbles ? div64_u64( lcd->bus_stats.deviation_total_ns, nibbles ) : 0,
+			lcd->bus_stats.deviation_max_ns );
 }
-static ssize_t klcd_write(struct file *p_file, const char __user *buf, size_t len, loff_t *off)
+
+static ssize_t klcd_deadline_misses_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	char kbuf[MAX_BUF_LENGTH];
-	unsigned long copyLength;
+	struct klcd_device *lcd = dev_get_drvdata( dev );
+	ssize_t len = 0;
+	unsigned int i;
 
-	if( buf == NULL){
-		printk( KERN_DEBUG "ERR: Empty user space buffer \n" );
-		return -ENOMEM;
-	}
+	for( i = 0; i < LCD_NUM_PRIORITIES; i++ )
+		len += sprintf( buf + len, "priority %u updates %lu misses %lu latency_max_us %lu\n", i,
+				lcd->bus_stats.updates[i], lcd->bus_stats.deadline_misses[i], lcd->bus_stats.latency_max_us[i] );
 
-	memset( kbuf, '\0', sizeof(char) * MAX_BUF_LENGTH );
-	copyLength = MIN( (MAX_BUF_LENGTH-1), (unsigned long) (len-1) );
+	return len;
+}
 
-	if(copyLength < 0)
-		copyLength = 0;
+static ssize_t klcd_planner_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct klcd_device *lcd = dev_get_drvdata( dev );
+	ssize_t len = 0;
+	unsigned int i;
 
-	// Copy user space buffer to kernel space buffer
-	if( copy_from_user(&kbuf, buf, copyLength ) ){
-		printk( KERN_DEBUG "ERR: Failed to copy from user space buffer \n" );
-		return -EFAULT;
-	}
+	for( i = 0; i < KLCD_MOVE_COUNT; i++ )
+		len += sprintf( buf + len, "%s%s %lu", i ? " " : "", lcd_plan_names[i], lcd->plan_stats[i] );
+	len += sprintf( buf + len, "\n" );
 
-	//printk( KERN_INFO "***** value copied from user space:  %s *****\n", kbuf );
-	//printk( KERN_INFO "***** copyLength:  %lu *****\n", copyLength );
-	
-	// clear display
-	lcd_clearDisplay();
+	return len;
+}
 
-	// print on the first line by default
-	lcd_print( kbuf, LCD_FIRST_LINE);
+static ssize_t klcd_playlist_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct klcd_device *lcd = dev_get_drvdata( dev );
+	ssize_t len;
 
-	printk(KERN_INFO "klcd Driver: write()\n");
+	mutex_lock( &lcd->play_lock );
+	len = sprintf( buf, "%s frames %u pass %u shown %lu late %lu\n",
+		       lcd->play.frames == NULL ? "none" : lcd->play.finished ? "finished" : "playing",
+		       lcd->play.count, lcd->play.pass, lcd->play.shown, lcd->play.late );
+	mutex_unlock( &lcd->play_lock );
 
 	return len;
 }
 
-static long klcd_ioctl( struct file *p_file, unsigned int ioctl_command, unsigned long arg)
+static ssize_t klcd_timing_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	struct ioctl_mesg ioctl_arguments;
+	struct klcd_device *lcd = dev_get_drvdata( dev );
 
-	printk(KERN_INFO "klcd Driver: ioctl\n");
-      	
-	if( ((const void *)arg) == NULL){
-		printk( KERN_DEBUG "ERR: Invalid argument for klcd IOCTL \n");
+	return sprintf( buf, "nibble_us %u pulse_us %u%s recoveries %u\n", lcd->timing.nibble_us, lcd->timing.pulse_us,
+			lcd->timing_calibrated ? " calibrated" : "", lcd->calibrate_recoveries );
+}
+
+static ssize_t klcd_calibrate_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct klcd_device *lcd = dev_get_drvdata( dev );
+	unsigned int run;
+	int ret;
+
+	if( kstrtouint( buf, 10, &run ) )
 		return -EINVAL;
+
+	if( run ){
+		ret = lcd_calibrate_run( lcd );
+		if( ret < 0 )
+			return ret;
 	}
 
-	memset( ioctl_arguments.kbuf, '\0', sizeof(char) * MAX_BUF_LENGTH );
+	return count;
+}
 
-	// copy ioctl command argument from user space
-	if( copy_from_user( &ioctl_arguments, (const void *)arg, sizeof(ioctl_arguments) ) ){
-		printk( KERN_DEBUG "ERR: Failed to copy from user space buffer \n" );
-		return -EFAULT;
-	}
+static DEVICE_ATTR(contents, S_IRUGO | S_IWUSR, klcd_contents_show, klcd_contents_store);
+static DEVICE_ATTR(geometry, S_IRUGO,           klcd_geometry_show, NULL);
+static DEVICE_ATTR(cursor,   S_IRUGO | S_IWUSR, klcd_cursor_show,   klcd_cursor_store);
+static DEVICE_ATTR(scrub_interval, S_IRUGO | S_IWUSR, klcd_scrub_interval_show, klcd_scrub_interval_store);
+static DEVICE_ATTR(scrub_cells,    S_IRUGO | S_IWUSR, klcd_scrub_cells_show,    klcd_scrub_cells_store);
+static DEVICE_ATTR(scrub_repaired, S_IRUGO,           klcd_scrub_repaired_show, NULL);
+static DEVICE_ATTR(bus_timing,      S_IRUGO,          klcd_bus_timing_show,      NULL);
+static DEVICE_ATTR(deadline_misses, S_IRUGO,          klcd_deadline_misses_show, NULL);
+static DEVICE_ATTR(timing,          S_IRUGO,          klcd_timing_show,          NULL);
+static DEVICE_ATTR(planner,         S_IRUGO,          klcd_planner_show,         NULL);
+static DEVICE_ATTR(playlist,        S_IRUGO,          klcd_playlist_show,        NULL);
+static DEVICE_ATTR(calibrate,       S_IWUSR,          NULL,                      klcd_calibrate_store);
 
-	switch( (char) ioctl_command ){
-		case IOCTL_CLEAR_DISPLAY:
-			lcd_clearDisplay();
-			break;
+static ssize_t klcd_state_read(struct file *p_file, struct kobject *kobj, struct bin_attribute *attr,
+			       char *buf, loff_t off, size_t count)
+{
+	struct klcd_device *lcd = dev_get_drvdata( container_of( kobj, struct device, kobj ) );
+	struct klcd_state state;
 
-		case IOCTL_PRINT_ON_FIRSTLINE:
-			lcd_print( ioctl_arguments.kbuf, LCD_FIRST_LINE);
-			break;
+	if( off >= sizeof(state) )
+		return 0;
+	count = MIN( count, (size_t) (sizeof(state) - off) );
 
-		case IOCTL_PRINT_ON_SECONDLINE:
-			lcd_print( ioctl_arguments.kbuf, LCD_SECOND_LINE);
-			break;
+	lcd_state_save( lcd, &state );
+	memcpy( buf, (char *) &state + off, count );
 
-		case IOCTL_PRINT_WITH_POSITION:
-			lcd_print_WithPosition( ioctl_arguments.kbuf, ioctl_arguments.lineNumber, ioctl_arguments.nthCharacter);
-			break;
+	return count;
+}
 
-		case IOCTL_CURSOR_ON:
-			lcd_cursor_on();
-			break;
+static ssize_t klcd_state_write(struct file *p_file, struct kobject *kobj, struct bin_attribute *attr,
+				char *buf, loff_t off, size_t count)
+{
+	struct klcd_device *lcd = dev_get_drvdata( container_of( kobj, struct device, kobj ) );
+	struct klcd_state state;
+	int ret;
 
-		case IOCTL_CURSOR_OFF:
-			lcd_cursor_off();
-			break;
+	if( off != 0 || count != sizeof(state) )
+		return -EINVAL;
 
-		default:
-			printk(KERN_DEBUG "klcd Driver (ioctl): No such command \n");
-			return -ENOTTY;
-	}
-	
-	return 0;
+	memcpy( &state, buf, sizeof(state) );
+
+	ret = lcd_state_restore( lcd, &state );
+	return (ret < 0) ? ret : count;
+}
+
+static struct bin_attribute klcd_state_attribute = {
+	.attr	= { .name = "state", .mode = S_IRUGO | S_IWUSR },
+	.size	= sizeof(struct klcd_state),
+	.read	= klcd_state_read,
+	.write	= klcd_state_write,
+};
+
+static struct attribute *klcd_attributes[] = {
+	&dev_attr_line1.attr,
+	&dev_attr_line2.attr,
+	&dev_attr_line3.attr,
+	&dev_attr_line4.attr,
+	&dev_attr_contents.attr,
+	&dev_attr_geometry.attr,
+	&dev_attr_cursor.attr,
+	&dev_attr_scrub_interval.attr,
+	&dev_attr_scrub_cells.attr,
+	&dev_attr_scrub_repaired.attr,
+	&dev_attr_bus_timing.attr,
+	&dev_attr_deadline_misses.attr,
+	&dev_attr_timing.attr,
+	&dev_attr_planner.attr,
+	&dev_attr_playlist.attr,
+	&dev_attr_calibrate.attr,
+	NULL,
+};
+
+/*
+ * description:		hide the lineN attributes of the lines the LCD does not have.
+*/
+static umode_t klcd_attribute_visible(struct kobject *kobj, struct attribute *attr, int n)
+{
+	struct klcd_device *lcd = dev_get_drvdata( container_of( kobj, struct device, kobj ) );
+	unsigned int line;
+
+	for( line = lcd->rows; line < LCD_MAX_LINES; line++ )
+		if( attr == &klcd_line_attributes[line]->attr )
+			return 0;
+
+	return attr->mode;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0)
+static struct bin_attribute *klcd_bin_attributes[] = {
+	&klcd_state_attribute,
+	NULL,
+};
+#endif
+
+static const struct attribute_group klcd_attribute_group = {
+	.attrs		= klcd_attributes,
+	.is_visible	= klcd_attribute_visible,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0)
+	.bin_attrs	= klcd_bin_attributes,
+#endif
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0)
+/* the attributes are added by device_create_with_groups(), before userspace hears of the device */
+static const struct attribute_group *klcd_attribute_groups[] = {
+	&klcd_attribute_group,
+	NULL,
+};
+#else
+/*
+ * description:		add the sysfs attributes to the klcd class device of an LCD.
+ *			Older kernels cannot add them together with the device.
+*/
+static int klcd_sysfs_create(struct klcd_device *lcd)
+{
+	int ret;
+
+	ret = sysfs_create_group( &lcd->dev->kobj, &klcd_attribute_group );
+	if( ret < 0 )
+		return ret;
+
+	ret = device_create_bin_file( lcd->dev, &klcd_state_attribute );
+	if( ret < 0 )
+		sysfs_remove_group( &lcd->dev->kobj, &klcd_attribute_group );
+
+	return ret;
+}
+
+/*
+ * description:		remove the sysfs attributes from the klcd class device of an LCD.
+*/
+static void klcd_sysfs_remove(struct klcd_device *lcd)
+{
+	device_remove_bin_file( lcd->dev, &klcd_state_attribute );
+	sysfs_remove_group( &lcd->dev->kobj, &klcd_attribute_group );
 }
+#endif
 
 
 /* file operation structure */
 static struct file_operations klcd_fops =
 {
 	.owner = THIS_MODULE,
+	.llseek  = klcd_llseek,
 	.open  =  klcd_open,
 	.release = klcd_close,
 	.read    = klcd_read,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,16,0)
+	.write_iter   = klcd_write_iter,
+	.splice_write = iter_file_splice_write,
+#else
 	.write   = klcd_write,
+#endif
+	.poll    = klcd_poll,
+	.fsync   = klcd_fsync,
 	.unlocked_ioctl	= klcd_ioctl,
 };
 
+// ************* LCD Instances *******************************************************************
+
+/* Every LCD is a platform device bound to this driver. LCDs are described in the device tree, one node
+   per LCD, for example two 20x4 panels:
+
+	lcd0 {
+		compatible = "hsm5xw,klcd";
+		rs-gpios     = <&gpio2 3 0>;
+		enable-gpios = <&gpio2 4 0>;
+		rw-gpios     = <&gpio2 2 0>;		// optional, leave out if R/W is tied to ground
+		data-gpios   = <&gpio2 1 0>, <&gpio1 14 0>, <&gpio0 26 0>, <&gpio1 12 0>;	// DB4 - DB7
+		display-height-chars = <4>;
+		display-width-chars  = <20>;
+		klcd,nibble-us = <50>;			// optional, default nibble_us
+		klcd,pulse-us  = <1>;			// optional, default pulse_us
+		klcd,transport = "gpio";		// optional, default transport
+	};
+
+   Each LCD gets its own character device (/dev/klcd for the first one, then /dev/klcd1, /dev/klcd2, ...),
+   its own class device with the sysfs attributes, its own bus thread and its own shadow buffers.
+   Without any "hsm5xw,klcd" node in the device tree (or without a device tree at all) the module
+   registers one 16x2 LCD on the LCD_*_PIN_NUMBER pins of klcd.h, as before, unless legacy_pins=0.
+*/
+
+static bool legacy_pins = true;
+module_param( legacy_pins, bool, S_IRUGO );
+MODULE_PARM_DESC( legacy_pins, "without \"" KLCD_COMPATIBLE "\" device tree nodes, drive a 16x2 LCD on the pins of klcd.h (default 1)" );
+
+static DEFINE_IDA( klcd_ida );			// ids (minor numbers) of the probed LCDs
+static struct platform_device *klcd_legacy_device;	// the LCD on the legacy pins, if registered
+
+/*
+ * description:		read one GPIO of an LCD from its device tree node.
+ *
+ * @param name		the property, e.g. "rs-gpios"
+ * @param index		the GPIO within the property
+ * @return		the GPIO number, or a negative error code (-EPROBE_DEFER if its controller is not there yet)
+*/
+static int klcd_parse_gpio(struct device *dev, const char *name, int index)
+{
+	int gpio = of_get_named_gpio( dev->of_node, name, index );
+
+	if( gpio < 0 && gpio != -EPROBE_DEFER )
+		printk( KERN_DEBUG "ERR: %s: Invalid or missing %s \n", dev_name(dev), name );
+
+	return gpio;
+}
+
+/*
+ * description:		read the configuration of an LCD from its device tree node.
+ *
+ * @param pdata		filled in from the node. Properties that are left out keep their value.
+ * @return		0 on success, or a negative error code
+*/
+static int klcd_parse_dt(struct device *dev, struct klcd_platform_data *pdata)
+{
+	struct device_node *np = dev->of_node;
+	unsigned int i;
+	int count;
+	int gpio;
+
+	gpio = klcd_parse_gpio( dev, "rs-gpios", 0 );
+	if( gpio < 0 )
+		return gpio;
+	pdata->pins.rs = gpio;
+
+	gpio = klcd_parse_gpio( dev, "enable-gpios", 0 );
+	if( gpio < 0 )
+		return gpio;
+	pdata->pins.e = gpio;
+
+	pdata->pins.rw = -1;
+	if( of_find_property( np, "rw-gpios", NULL ) )
+	{
+		gpio = klcd_parse_gpio( dev, "rw-gpios", 0 );
+		if( gpio < 0 )
+			return gpio;
+		pdata->pins.rw = gpio;
+	}
+
+	// 4 data lines are DB4 - DB7. The 8 bit interface is not supported.
+	count = of_count_phandle_with_args( np, "data-gpios", "#gpio-cells" );
+	if( count < 0 )
+		count = 0;
+	pdata->bus_width = count;
+	if( count != ARRAY_SIZE(pdata->pins.db) )
+	{
+		printk( KERN_DEBUG "ERR: %s: %d data-gpios, only 4 bit mode is supported \n", dev_name(dev), count );
+		return -EINVAL;
+	}
+
+	for( i = 0; i < ARRAY_SIZE(pdata->pins.db); i++ )
+	{
+		gpio = klcd_parse_gpio( dev, "data-gpios", i );
+		if( gpio < 0 )
+			return gpio;
+		pdata->pins.db[i] = gpio;
+	}
+
+	of_property_read_u32( np, "display-height-chars", &pdata->rows );
+	of_property_read_u32( np, "display-width-chars",  &pdata->columns );
+	of_property_read_u32( np, "klcd,nibble-us", &pdata->timing.nibble_us );
+	of_property_read_u32( np, "klcd,pulse-us",  &pdata->timing.pulse_us );
+	of_property_read_string( np, "klcd,transport", &pdata->transport );
+
+	return 0;
+}
+
+/*
+ * description:		stop new opens and file operations on an LCD, and wait for the file operations under way.
+ *			They finish because the bus thread still runs at this point.
+*/
+static void klcd_remove_start(struct klcd_device *lcd)
+{
+	mutex_lock( &klcd_devices_lock );
+	klcd_devices[lcd->id] = NULL;
+	mutex_unlock( &klcd_devices_lock );
+
+	down_write( &lcd->remove_lock );
+	lcd->removed = true;
+	up_write( &lcd->remove_lock );
+
+	wake_up_interruptible( &lcd->term_wait );	// pollers see POLLHUP
+}
+
+/*
+ * description:		bring up one LCD: claim its bus, initialize it, start its bus thread and add its
+ *			character device and sysfs attributes.
+*/
+static int klcd_probe(struct platform_device *pdev)
+{
+	struct klcd_platform_data *pdata = pdev->dev.platform_data;
+	struct klcd_platform_data config = {
+		.rows		= LCD_NUM_LINES,
+		.columns	= NUM_CHARS_PER_LINE,
+		.timing		= { .nibble_us = nibble_us, .pulse_us = pulse_us },
+		.transport	= transport,
+	};
+	struct klcd_device *lcd;
+	int ret;
+
+	// the configuration, from the device tree or from the legacy device
+	if( pdev->dev.of_node )
+	{
+		ret = klcd_parse_dt( &pdev->dev, &config );
+		if( ret < 0 )
+			return ret;
+	}
+	else if( pdata )
+		config = *pdata;
+	else
+		return -EINVAL;
+
+	if( ( config.rows != 1 && config.rows != 2 && config.rows != LCD_MAX_LINES ) ||
+	    config.columns == 0 || config.columns > LCD_MAX_COLUMNS || config.rows * config.columns > LCD_MAX_CELLS )
+	{
+		printk( KERN_DEBUG "ERR: Unsupported geometry %ux%u \n", config.columns, config.rows );
+		return -EINVAL;
+	}
+
+	// not devm: open files keep the LCD until they are closed, which can be after the unbind
+	lcd = kzalloc( sizeof(*lcd), GFP_KERNEL );
+	if( lcd == NULL )
+		return -ENOMEM;
+	kref_init( &lcd->kref );			// the platform device's reference
+	init_rwsem( &lcd->remove_lock );
+
+	lcd->pins     = config.pins;
+	lcd->rw_wired = config.pins.rw >= 0;
+	lcd->rows     = config.rows;
+	lcd->columns  = config.columns;
+	lcd->cells    = config.rows * config.columns;
+	lcd->timing   = config.timing;
+	lcd->scrub_cells = LCD_SCRUB_CELLS;
+	lcd_timing_clamp( &lcd->timing );
+
+	mutex_init( &lcd->mutex );
+	mutex_init( &lcd->cgram_lock );
+	mutex_init( &lcd->widget_lock );
+	mutex_init( &lcd->play_lock );
+	mutex_init( &lcd->term_lock );
+	seqlock_init( &lcd->shadow_lock );
+	init_waitqueue_head( &lcd->bus_wait );
+	init_waitqueue_head( &lcd->term_wait );
+	INIT_KFIFO( lcd->term_fifo );
+
+	// pick the bus transport before claiming anything
+	lcd->transport = lcd_transport_select( config.transport );
+	if( lcd->transport == NULL )
+	{
+		printk( KERN_DEBUG "ERR: Unknown transport \"%s\" \n", config.transport );
+		ret = -EINVAL;
+		goto fail_alloc;
+	}
+
+	// the id is the minor number, and names the LCD
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0)
+	lcd->id = ida_alloc_max( &klcd_ida, MINOR_NUM_COUNT - 1, GFP_KERNEL );
+#else
+	lcd->id = ida_simple_get( &klcd_ida, 0, MINOR_NUM_COUNT, GFP_KERNEL );
+#endif
+	if( lcd->id < 0 )
+	{
+		ret = lcd->id;
+		goto fail_alloc;
+	}
+
+	if( lcd->id == 0 )
+		snprintf( lcd->name, sizeof(lcd->name), "%s", DEVICE_NAME );
+	else
+		snprintf( lcd->name, sizeof(lcd->name), "%s%d", DEVICE_NAME, lcd->id );
+
+	// set up the bus (GPIO pins for the gpio transport)
+	ret = lcd->transport->setup( lcd );
+	if( ret < 0 )
+	{
+		printk( KERN_DEBUG "ERR: Failed to set up %s transport \n", lcd->transport->name );
+		goto fail_id;
+	}
+
+	// initialize LCD once
+	if( warm_attach )
+		lcd_warm_attach( lcd );
+	else
+		lcd_initialize( lcd );
+
+	// start the bus thread
+	lcd_play_init( lcd );
+	ret = lcd_queue_init( lcd );
+	if( ret < 0 )
+	{
+		printk( KERN_DEBUG "ERR: Failed to start the bus thread \n" );
+		goto fail_transport;
+	}
+
+	// find the fastest timing the panel can follow
+	if( calibrate && lcd_calibrate_run( lcd ) < 0 )
+		printk( KERN_DEBUG "ERR: %s: Timing calibration failed, keeping nibble_us %u pulse_us %u \n",
+			lcd->name, lcd->timing.nibble_us, lcd->timing.pulse_us );
+
+	// start checking the panel against the shadow buffer
+	lcd_scrub_set_interval( lcd, scrub_interval );
+
+	// add the character device once the LCD can be written
+	lcd->devt = MKDEV( MAJOR(dev_number), MINOR_NUM_START + lcd->id );
+	lcd->cdev = cdev_alloc();
+	if( lcd->cdev == NULL )
+	{
+		ret = -ENOMEM;
+		goto fail_queue;
+	}
+	lcd->cdev->ops   = &klcd_fops;
+	lcd->cdev->owner = THIS_MODULE;
+
+	mutex_lock( &klcd_devices_lock );
+	klcd_devices[lcd->id] = lcd;
+	mutex_unlock( &klcd_devices_lock );
+
+	ret = cdev_add( lcd->cdev, lcd->devt, 1 );
+	if( ret < 0 )
+	{
+		printk( KERN_DEBUG "ERR: Failed to add cdev \n" );
+		goto fail_cdev;
+	}
+
+	// create a device and registers it with sysfs
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0)
+	lcd->dev = device_create_with_groups( klcd_class, &pdev->dev, lcd->devt, lcd, klcd_attribute_groups,
+					      "%s", lcd->name );
+#else
+	lcd->dev = device_create( klcd_class, &pdev->dev, lcd->devt, lcd, "%s", lcd->name );
+#endif
+	if( IS_ERR(lcd->dev) )
+	{
+		printk( KERN_DEBUG "ERR: Failed to create device structure \n" );
+		ret = PTR_ERR( lcd->dev );
+		goto fail_cdev;
+	}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0)
+	ret = klcd_sysfs_create( lcd );
+	if( ret < 0 )
+	{
+		printk( KERN_DEBUG "ERR: Failed to create sysfs attributes \n" );
+		goto fail_device;
+	}
+#endif
+
+	platform_set_drvdata( pdev, lcd );
+
+	printk(KERN_INFO "klcd Driver: %s is a %ux%u LCD on the %s transport \n", lcd->name, lcd->columns, lcd->rows,
+	       lcd->transport->name);
+	return 0;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0)
+fail_device:
+	device_destroy( klcd_class, lcd->devt );
+#endif
+fail_cdev:
+	klcd_remove_start( lcd );		// a file opened meanwhile only gets -ENODEV
+	cdev_del( lcd->cdev );
+fail_queue:
+	lcd_play_exit( lcd );
+	lcd_queue_exit( lcd );
+fail_transport:
+	lcd->transport->release( lcd );
+fail_id:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0)
+	ida_free( &klcd_ida, lcd->id );
+#else
+	ida_simple_remove( &klcd_ida, lcd->id );
+#endif
+fail_alloc:
+	kref_put( &lcd->kref, klcd_device_release );
+	return ret;
+}
+
+/*
+ * description:		take one LCD down again, in the reverse order of klcd_probe().
+*/
+static void klcd_remove_lcd(struct klcd_device *lcd)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0)
+	// remove the attributes before the LCD goes away (newer kernels remove them with the device)
+	klcd_sysfs_remove( lcd );
+#endif
+
+	// remove device (and its attributes)
+	device_destroy( klcd_class, lcd->devt );
+
+	// files that are still open get -ENODEV from now on
+	klcd_remove_start( lcd );
+
+	// remove a cdev from the system (open inodes keep it until they are closed)
+	cdev_del( lcd->cdev );
+
+	// stop the playlist and the bus thread (and with it the scrubber)
+	lcd_play_exit( lcd );
+	lcd_queue_exit( lcd );
+
+	// turn off LCD display, unless it is to be taken over by a warm attach
+	if( !keep_display )
+		lcd_display_off( lcd );
+
+	// release the bus (GPIO pins for the gpio transport)
+	lcd->transport->release( lcd );
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0)
+	ida_free( &klcd_ida, lcd->id );
+#else
+	ida_simple_remove( &klcd_ida, lcd->id );
+#endif
+
+	// freed now, or at the last close of a file that is still open
+	kref_put( &lcd->kref, klcd_device_release );
+}
+
+static int klcd_remove(struct platform_device *pdev)
+{
+	klcd_remove_lcd( platform_get_drvdata( pdev ) );
+	return 0;
+}
+
+static const struct of_device_id klcd_of_match[] = {
+	{ .compatible = KLCD_COMPATIBLE },
+	{ }
+};
+MODULE_DEVICE_TABLE( of, klcd_of_match );
+
+static struct platform_driver klcd_driver = {
+	.probe	= klcd_probe,
+	.remove	= klcd_remove,
+	.driver	= {
+		.name		= DEVICE_NAME,
+		.owner		= THIS_MODULE,
+		.of_match_table	= of_match_ptr( klcd_of_match ),
+	},
+};
+
+/*
+ * description:		register the LCD on the pins of klcd.h, if the device tree does not describe any LCD.
+ * @return		0 on success (also when no legacy LCD is needed), or a negative error code
+*/
+static int klcd_legacy_register(void)
+{
+	struct klcd_platform_data pdata = {
+		.pins		= {
+			.rs	= LCD_RS_PIN_NUMBER,
+			.e	= LCD_E_PIN_NUMBER,
+			.rw	= rw_wired ? LCD_RW_PIN_NUMBER : -1,
+			.db	= { LCD_DB4_PIN_NUMBER, LCD_DB5_PIN_NUMBER, LCD_DB6_PIN_NUMBER, LCD_DB7_PIN_NUMBER },
+		},
+		.rows		= LCD_NUM_LINES,
+		.columns	= NUM_CHARS_PER_LINE,
+		.bus_width	= 4,
+		.timing		= { .nibble_us = nibble_us, .pulse_us = pulse_us },
+		.transport	= transport,
+	};
+	struct device_node *np;
+
+	if( !legacy_pins )
+		return 0;
+
+	np = of_find_compatible_node( NULL, NULL, KLCD_COMPATIBLE );
+	if( np )
+	{
+		of_node_put( np );
+		return 0;
+	}
+
+	klcd_legacy_device = platform_device_register_data( NULL, DEVICE_NAME, -1, &pdata, sizeof(pdata) );
+	if( IS_ERR(klcd_legacy_device) )
+	{
+		int ret = PTR_ERR( klcd_legacy_device );
+
+		klcd_legacy_device = NULL;
+		return ret;
+	}
+
+	return 0;
+}
+
 /*
  * description:	initialize the device module	
 */
 static int __init klcd_init(void)
 {
-	struct device *dev_ret;
+	int ret;
+
+	// build the character ROM table
+	if( lcd_rom_build() < 0 )
+		return -EINVAL;
 
 	// dynamically allocate device major number
 	if( alloc_chrdev_region( &dev_number, MINOR_NUM_START , MINOR_NUM_COUNT , DEVICE_NAME ) < 0) 
@@ -646,39 +4874,30 @@ static int __init klcd_init(void)
 		
 		return PTR_ERR( klcd_class ) ;
 	}
-			
-	// create a device and registers it with sysfs
-	dev_ret = device_create( klcd_class, NULL, dev_number, NULL, DEVICE_NAME );
-	
-	if( IS_ERR(dev_ret) )
+
+	// probe the LCDs of the device tree
+	ret = platform_driver_register( &klcd_driver );
+	if( ret < 0 )
 	{
 		class_destroy( klcd_class );
 		unregister_chrdev_region( dev_number, MINOR_NUM_COUNT );
-		printk( KERN_DEBUG "ERR: Failed to create device structure \n" );		
+		printk( KERN_DEBUG "ERR: Failed to register the platform driver \n" );
 
-		return PTR_ERR( dev_ret );
+		return ret;
 	}
 
-	// initialize a cdev structure
-	cdev_init( &klcd_cdev, &klcd_fops);
-
-	// add a character device to the system
-	if( cdev_add( &klcd_cdev, dev_number, MINOR_NUM_COUNT) < 0 )
+	// or the one on the legacy pins
+	ret = klcd_legacy_register();
+	if( ret < 0 )
 	{
-		device_destroy( klcd_class, dev_number);
-		class_destroy(  klcd_class );
+		platform_driver_unregister( &klcd_driver );
+		class_destroy( klcd_class );
 		unregister_chrdev_region( dev_number, MINOR_NUM_COUNT );
-		printk( KERN_DEBUG "ERR: Failed to add cdev \n" );		
+		printk( KERN_DEBUG "ERR: Failed to register the legacy LCD \n" );
 
-		return -1;		
+		return ret;
 	}
 
-	// setup GPIO pins
-	lcd_pin_setup_All();
-
-	// initialize LCD once
-	lcd_initialize();
-
 	printk(KERN_INFO "klcd Driver Initialized. \n");
 	return 0;
 }
@@ -688,23 +4907,16 @@ static int __init klcd_init(void)
 */
 static void __exit klcd_exit(void)
 {
-	// turn off LCD display
-	lcd_display_off();
-
-	// remove a cdev from the system
-	cdev_del( &klcd_cdev);
-
-	// remove device
-	device_destroy( klcd_class, dev_number );
+	// remove the LCDs
+	if( klcd_legacy_device )
+		platform_device_unregister( klcd_legacy_device );
+	platform_driver_unregister( &klcd_driver );
 
 	// destroy class
 	class_destroy( klcd_class );	
 
 	// deallocate device major number
-	unregister_chrdev_region( MAJOR(dev_number), MINOR_NUM_COUNT );
-
-	// releasse GPIO pins
-	lcd_pin_release_All();
+	unregister_chrdev_region( dev_number, MINOR_NUM_COUNT );
 
 	printk(KERN_INFO "klcd Driver Exited. \n");
 }
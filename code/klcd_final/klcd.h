@@ -19,8 +19,12 @@
 
 // ******** LCD Pin Configuration *****************************************************************
 
+/* Pins of the LCD registered when the device tree has no "hsm5xw,klcd" node (see legacy_pins).
+   LCDs described in the device tree bring their own pins, see README.md.
+*/
 #define LCD_RS_PIN_NUMBER	67  // LCD_RS: P8_8  (GPIO pin 67)
 #define LCD_E_PIN_NUMBER	68  // LCD_E:  P8_10 (GPIO pin 68)
+#define LCD_RW_PIN_NUMBER	66  // LCD_RW: P8_7  (GPIO pin 66), only used with rw_wired=1
 
 #define LCD_DB4_PIN_NUMBER	65  // LCD_DB4: P8_18 (GPIO pin 65)
 #define LCD_DB5_PIN_NUMBER	46  // LCD_DB5: P8_16 (GPIO pin 46)
@@ -36,16 +40,44 @@
 #define LCD_FIRST_LINE		1
 #define LCD_SECOND_LINE		2
 
-#define NUM_CHARS_PER_LINE      16  // the number of characters per line
+#define NUM_CHARS_PER_LINE      16  // the number of characters per line of the legacy 16x2 LCD
+#define LCD_NUM_LINES		2
+#define LCD_NUM_CELLS		(LCD_NUM_LINES * NUM_CHARS_PER_LINE)
+
+#define LCD_MAX_LINES		4    // largest geometry one HD44780 can drive (80 characters of DDRAM)
+#define LCD_MAX_COLUMNS		40
+#define LCD_MAX_CELLS		80
+
+#define LCD_FIRST_LINE_ADDRESS	0x00 // DDRAM address of the first character of each line
+#define LCD_SECOND_LINE_ADDRESS	0x40
+#define LCD_DDRAM_LINE_LENGTH	0x28 // DDRAM characters per line in 2-line mode (only 16 are visible)
+
+#define LCD_DDRAM_RING		(2 * LCD_DDRAM_LINE_LENGTH)	// addresses walked by the address counter in 2-line mode
+#define LCD_DDRAM_SIZE		0x80 // DDRAM address space of the HD44780 (7-bit address counter)
+#define LCD_CGRAM_SIZE		0x40 // CGRAM address space of the HD44780 (8 glyphs x 8 rows)
+#define LCD_CGRAM_GLYPHS	8    // the number of user defined glyphs in CGRAM
+#define LCD_CGRAM_CHAR_BASE	0x08 // character code of CGRAM glyph 0 (0x00 is avoided since it ends a string)
+
+// ******** Character Translation ******************************************************************
+
+#define LCD_ROM_PAGE_SIZE	256	// code points per page of the ROM lookup table
+#define LCD_ROM_DIRECTORY_SIZE	256	// pages in the table, covering U+0000 to U+FFFF
+#define LCD_ROM_MAX_PAGES	12	// pages actually populated by the largest ROM
+
+#define LCD_INVALID_CODEPOINT	0xFFFFFFFF
+#define LCD_UNKNOWN_CHAR	'?'	// shown for characters that are neither in ROM nor in CGRAM
 
 // ********* Linux driver Constants ******************************************************************
 
 #define MINOR_NUM_START		0   // minor number starts from 0
-#define MINOR_NUM_COUNT		1   // the number of minor numbers required
+#define MINOR_NUM_COUNT		8   // the number of minor numbers required, one per LCD
 
 #define MAX_BUF_LENGTH  	50  // maximum length of a buffer to copy from user space to kernel space
 
+#define LCD_TEXT_BUF_LENGTH	(4 * LCD_MAX_CELLS + 1)	// enough UTF-8 for every cell of the largest screen
+
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
 
 
 // ********* IOCTL COMMAND ARGUMENTS ******************************************************************
@@ -58,6 +90,63 @@
 #define IOCTL_PRINT_WITH_POSITION 	'3'
 #define IOCTL_CURSOR_ON			'4'
 #define IOCTL_CURSOR_OFF		'5'
+#define IOCTL_SET_PRIORITY		'6'	// argument: unsigned int, one of KLCD_PRIORITY_*
+
+#define IOCTL_DEFINE_WIDGET		'7'	// argument: struct klcd_widget_def
+#define IOCTL_SET_WIDGET		'8'	// argument: struct klcd_widget_value
+#define IOCTL_SET_MODE			'9'	// argument: unsigned int, one of KLCD_MODE_*
+#define IOCTL_PLAY			'A'	// argument: struct klcd_playlist, an empty one cancels
+
+#define KLCD_PRIORITY_NORMAL		0	// update priorities (queue lanes), higher is served first
+#define KLCD_PRIORITY_ALERT		1
+
+#define KLCD_MODE_LEGACY		0	// each write() replaces the screen with its first 49 bytes
+#define KLCD_MODE_TERMINAL		1	// write() streams text onto the bottom line, '\n' scrolls up
+#define KLCD_MODE_CELLS			2	// write() replaces the cells from the file position onwards
+
+#define KLCD_MAX_WIDGETS		8
+
+#define KLCD_WIDGET_BARGRAPH		0	// horizontal bar, 5 steps per cell
+#define KLCD_WIDGET_NUMBER		1	// right aligned decimal number
+
+struct klcd_widget_def{				// a structure to be passed to IOCTL_DEFINE_WIDGET
+	unsigned int id;			// 0 to KLCD_MAX_WIDGETS - 1
+	unsigned int type;			// KLCD_WIDGET_BARGRAPH or KLCD_WIDGET_NUMBER
+
+	unsigned int lineNumber;		// position of the leftmost cell (the widget stays on one line)
+	unsigned int nthCharacter;
+	unsigned int width;			// the number of cells, 0 removes the widget
+
+	int min;				// KLCD_WIDGET_BARGRAPH: values for an empty and a full bar
+	int max;
+	int value;				// initial value
+};
+
+struct klcd_widget_value{			// a structure to be passed to IOCTL_SET_WIDGET
+	unsigned int id;
+	int value;
+};
+
+#define KLCD_MAX_FRAMES			256
+#define KLCD_PLAYLIST_GLYPHS		4	// CGRAM glyphs a playlist can define
+
+struct klcd_frame{				// one frame of a playlist
+	unsigned int at_ms;			// time from the start of the pass, not less than the previous frame
+	unsigned int cell;			// first cell replaced, (line - 1) * columns + nthCharacter
+	unsigned int count;			// the number of cells replaced
+	char text[LCD_MAX_CELLS];		/* character codes (not UTF-8). 0x00-0x0F show the playlist glyph
+						   (code % 8), which must be defined by some frame
+						*/
+	int glyph;				// playlist glyph redefined by this frame, -1 for none
+	unsigned char rows[8];			// its 5x8 bitmap, top row first
+};
+
+struct klcd_playlist{				// a structure to be passed to IOCTL_PLAY
+	const struct klcd_frame *frames;
+	unsigned int count;			// the number of frames, 0 cancels the playlist
+	unsigned int loops;			// passes to play, 0 for forever
+	unsigned int period_ms;			// length of a pass, more than the time of its last frame
+};
 
 struct ioctl_mesg{				// a structure to be passed to ioctl argument
 	char kbuf[MAX_BUF_LENGTH];
@@ -67,15 +156,191 @@ struct ioctl_mesg{				// a structure to be passed to ioctl argument
 };
 
 
+// ********* Update Queue *************************************************************************
+
+#define LCD_NUM_PRIORITIES	2
+#define LCD_QUEUE_MAX_ASYNC	64	// updates an LCD holds for its submitters before they have to wait
+
+struct klcd_device;				// one LCD, see "LCD Instances" below
+
+enum klcd_update_type
+{
+	KLCD_UPDATE_TEXT,			// new character codes for a range of cells
+	KLCD_UPDATE_COMMAND,			// a display command such as clear or cursor on/off
+	KLCD_UPDATE_BARRIER,			// nothing, completes once everything queued before it is shown
+};
+
+struct klcd_update
+{
+	struct llist_node node;			// entry in the inbox of its priority, until the bus thread takes it
+	struct list_head list;			// entry in the lane of its priority, bus thread only
+	enum klcd_update_type type;
+	unsigned int priority;
+	bool async;				// owned by the queue and freed once applied, nobody waits for it
+	u32 seq;				// submission order across all lanes
+
+	unsigned int cell;			// KLCD_UPDATE_TEXT: first cell
+	unsigned int count;			//                   the number of cells
+	unsigned int done;			//                   cells already applied (when preempted)
+	char text[LCD_MAX_CELLS];
+
+	void (*command)(struct klcd_device *lcd);	// KLCD_UPDATE_COMMAND: function that sends the command
+
+	ktime_t submitted;			// time the update was queued
+	struct completion completion;		// signalled once the update has been applied (not for async updates)
+};
+
+struct klcd_bus_stats
+{
+	u64 nibbles;					// nibbles transferred over GPIO
+	u64 deviation_total_ns;				// sum and maximum of the time each nibble took beyond
+	u64 deviation_max_ns;				// its nominal time
+
+	unsigned long updates[LCD_NUM_PRIORITIES];		// updates applied, per priority
+	unsigned long deadline_misses[LCD_NUM_PRIORITIES];	// updates shown later than deadline_ms
+	unsigned long latency_max_us[LCD_NUM_PRIORITIES];	// worst time from submission to display
+};
+
+// ********* Playlists ***************************************************************************
+
+#define LCD_PLAY_CODEPOINT(n)	(0x110100 + (n))	// CGRAM key of playlist glyph n (beyond Unicode)
+#define LCD_PLAY_LATE_NS	(2 * NSEC_PER_MSEC)	// frames shown later than this are counted as late
+
+// ********* State Snapshot **********************************************************************
+
+#define KLCD_STATE_MAGIC	0x64636c6b	// "klcd"
+#define KLCD_STATE_VERSION	2
+
+struct klcd_state				// contents of the binary sysfs attribute "state"
+{
+	u32 magic;
+	u32 version;
+
+	u8  rows;				// geometry of the LCD, a snapshot only restores onto the same one
+	u8  columns;
+	u8  cells[LCD_MAX_CELLS];		// character codes shown, line 1 first
+	u8  cgram[LCD_CGRAM_SIZE];		// rows of the CGRAM glyphs
+	u32 glyphs[LCD_CGRAM_GLYPHS];		// code point each glyph stands for, LCD_INVALID_CODEPOINT if free
+
+	u8  cursor_visible;
+	u8  address;				// address counter (the cursor position)
+	u8  address_cgram;			// the address counter points to CGRAM
+	u8  timing_calibrated;			// nibble_us and pulse_us were found by a calibration (and are restored)
+	u32 nibble_us;
+	u32 pulse_us;
+};
+
+// ********* Terminal ****************************************************************************
+
+#define LCD_TERM_FIFO_SIZE	4096			// bytes buffered for terminal mode (a power of 2)
+#define LCD_TERM_LOW_WATER	(LCD_TERM_FIFO_SIZE / 2)	// blocked writers resume below this fill level
+#define LCD_TERM_CHUNK		64			// bytes moved between user space, ring and LCD at once
+
+struct klcd_source				// user space text being written (write() or write_iter())
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,16,0)
+	struct iov_iter *iter;
+#else
+	const char __user *buf;
+#endif
+};
+
+// ********* Widgets ******************************************************************************
+
+#define LCD_BAR_STEPS		5			// columns per cell of a bargraph
+#define LCD_BAR_CODEPOINT(n)	(0x110000 + (n))	// CGRAM key of the glyph with n columns set (beyond Unicode)
+
+struct klcd_widget
+{
+	unsigned int type;			// KLCD_WIDGET_BARGRAPH or KLCD_WIDGET_NUMBER
+	unsigned int cell;			// first cell
+	unsigned int width;			// the number of cells, 0 if the widget is not defined
+	int min;
+	int max;
+	int value;
+};
+
+struct klcd_file				// per open file state (file->private_data)
+{
+	struct klcd_device *lcd;		// the LCD the file was opened on
+	unsigned int priority;			// priority of updates made through this file
+	unsigned int mode;			// KLCD_MODE_LEGACY, KLCD_MODE_TERMINAL or KLCD_MODE_CELLS
+};
+
 // ********* Device Structures *********************************************************************
 
 #define CLASS_NAME  	"klcd"
 #define DEVICE_NAME 	"klcd"
+#define KLCD_COMPATIBLE	"hsm5xw,klcd"	// device tree nodes of LCDs driven by klcd
 
-static dev_t 		dev_number;	// dynamically allocated device major number
-struct cdev  		klcd_cdev;	// cdev structure
+static dev_t 		dev_number;	// dynamically allocated device major number, minor n for LCD n
+static struct klcd_device *klcd_devices[MINOR_NUM_COUNT];	// probed LCDs by id, for open()
+static DEFINE_MUTEX( klcd_devices_lock );
 static struct class *  	klcd_class;	// class structure
 
+// ********* Bus Timing ***************************************************************************
+
+struct klcd_timing
+{
+	unsigned int nibble_us;			// delay before every 4-bit transfer (instead of busy checking)
+	unsigned int pulse_us;			// RS setup time and E pulse width
+};
+
+#define LCD_TIMING_MIN_US	1	// range of nibble_us and pulse_us, wherever they come from (module parameters,
+#define LCD_NIBBLE_MAX_US	10000	// device tree, calibration or a state snapshot)
+#define LCD_PULSE_MAX_US	1000
+
+#define LCD_UDELAY_MAX_US	20	// shorter delays are busy-waited
+#define LCD_CLEAR_US		1600	// execution time of clear display and return home (1.52 ms)
+
+#define LCD_CALIBRATE_MIN_CELLS	8	// DDRAM beyond the visible cells of line 1 needed for the test patterns
+#define LCD_CALIBRATE_PASSES	3	// patterns written and read back for each step
+#define LCD_CALIBRATE_MIN_US	LCD_TIMING_MIN_US	// the calibration does not go below this
+
+// ********* Cursor Movement Planner **************************************************************
+
+enum klcd_move					// ways to bring the address counter to the next cell
+{
+	KLCD_MOVE_NONE,				// already there through auto-increment
+	KLCD_MOVE_SET,				// Set DDRAM Address
+	KLCD_MOVE_REWRITE,			// rewrite the unchanged cells in between
+	KLCD_MOVE_HOME,				// Return Home, then rewrite up to the cell
+	KLCD_MOVE_COUNT
+};
+
+struct klcd_costs				// cost of each instruction on the bus, in us
+{
+	unsigned int command;
+	unsigned int data;
+	unsigned int home;
+};
+
+// ********* Bus Transport ************************************************************************
+
+/* A transport moves bytes between the driver and the HD44780 controller. The display logic above it
+   only hands over byte streams tagged as command (RS_COMMAND_MODE) or data (RS_DATA_MODE), so each
+   backend is free to batch a whole stream in whatever way is fastest for its bus.
+*/
+struct klcd_transport
+{
+	const char *name;					// selected with "transport" or "klcd,transport"
+
+	int  (*setup)(struct klcd_device *lcd);			// claim and configure the bus
+	void (*release)(struct klcd_device *lcd);		// give the bus back
+
+	void (*write_nibble)(struct klcd_device *lcd, unsigned int rs_mode, char nibble);	/* a single 4-bit transfer
+												   (upper 4 bits of nibble),
+												   only used while the
+												   controller is being
+												   switched into 4 bit mode
+												*/
+	void (*write_bytes)(struct klcd_device *lcd, unsigned int rs_mode, const char *bytes, unsigned int count);	// send N full bytes
+	int  (*read_bytes)(struct klcd_device *lcd, unsigned int rs_mode, char *bytes, unsigned int count);	/* read N full bytes,
+													   or NULL if the bus
+													   is write only
+													*/
+};
+
 // ********* GPIO Support *************************************************************************
 
 typedef enum pin_dir
@@ -84,25 +349,244 @@ typedef enum pin_dir
 	OUTPUT_PIN = 1
 } PIN_DIRECTION;
 
-// ********* Function Prototypes *******************************************************************
+// ********* LCD Instances ************************************************************************
 
-static int  lcd_pin_setup(unsigned int pin_number);
-static void lcd_pin_setup_All( void );
-static void lcd_pin_release(unsigned int pin_number);
-static void lcd_pin_release_All( void );
+struct klcd_pins				// GPIO numbers of one LCD
+{
+	int rs;
+	int e;
+	int rw;					// -1 if R/W is tied to ground (the LCD cannot be read)
+	int db[4];				// DB4 to DB7
+};
 
+struct klcd_platform_data			// configuration of one LCD, from the device tree or the legacy pins
+{
+	struct klcd_pins pins;
+	unsigned int rows;			// 1, 2 or 4
+	unsigned int columns;			// up to LCD_MAX_COLUMNS, and rows * columns up to LCD_MAX_CELLS
+	unsigned int bus_width;			// data lines, only 4 bit mode is supported
+	struct klcd_timing timing;
+	const char *transport;			// name of the bus transport
+};
 
-static void lcd_instruction(char command);
-static void lcd_data(char data);
-static void lcd_initialize(void);
-static void lcd_print(char * msg, unsigned int lineNumber);
-static void lcd_print_WithPosition(char * msg, unsigned int lineNumber, unsigned int nthCharacter);
+struct klcd_emul_faults				// faults the emulator injects, set in debugfs as "<name>/fault_*"
+{
+	u32 delay_us;				// added before every nibble, like a slow bus
+	u32 corrupt_every;			// every nth character written to DDRAM is stored with bit 0 flipped, 0 for never
+	u32 read_error_every;			// every nth read fails with -EIO, 0 for never
+	u32 injected;				// corrupted characters and failed reads so far
 
-static void lcd_setLinePosition(unsigned int line);
-static void lcd_setPosition(unsigned int line, unsigned int nthCharacter);
-static void lcd_clearDisplay(void);
+	u32 writes;				// DDRAM writes and reads, counted for the _every settings
+	u32 reads;
+};
+
+struct klcd_emul				// state of the emulated HD44780 controller
+{
+	char ddram[LCD_DDRAM_SIZE];
+	char cgram[LCD_CGRAM_SIZE];
+
+	unsigned int address;			// address counter
+	bool select_cgram;			// address counter points to CGRAM instead of DDRAM
+	bool increment;				// entry mode I/D
+	bool four_bit;				// function set DL = 0
+	bool nibble_pending;			// upper half of a 4-bit transfer has been latched
+	char upper_nibble;
+	char display_control;			// last display on/off control instruction
+
+	struct klcd_emul_faults faults;
+	struct dentry *debugfs_dir;
+};
 
-static void lcd_cursor_on(void);
-static void lcd_cursor_off(void);
+struct klcd_cgram_slot				// one of the 8 CGRAM glyphs
+{
+	u32  codepoint;				// character shown by the glyph (LCD_BAR_CODEPOINT() for bargraph blocks)
+	bool used;
+	unsigned int pinned;			// users that need the glyph kept even while it is not on the screen
+};
+
+struct klcd_play				// the playlist of an LCD
+{
+	struct klcd_frame *frames;		// NULL if no playlist is loaded
+	unsigned int count;
+	unsigned int loops;			// passes to play, 0 for forever
+	unsigned int period_ms;
+	unsigned int glyphs;			// playlist glyphs in use (bit n for glyph n)
+
+	unsigned int next;			// frame to be shown next
+	unsigned int pass;
+	bool finished;
+	ktime_t start;				// start of the first pass
+
+	unsigned long shown;			// frames shown, and frames shown after their time or skipped
+	unsigned long late;
+};
+
+/* Everything the driver knows about one LCD. It is allocated when the LCD is probed, and every function
+   that talks to an LCD or looks at its state takes it as its first argument. It is reference counted:
+   the platform device holds one reference and every open file another, so a file can outlive the
+   removal of its LCD. Such a file only gets -ENODEV.
+*/
+struct klcd_device
+{
+	int id;					// minor number, and the n of /dev/klcdn (0 is /dev/klcd)
+	char name[16];
+	struct kref kref;
+	struct cdev *cdev;			// allocated on its own, since open inodes hold it until their last close
+	dev_t devt;
+	struct device *dev;			// the klcd class device (holds the sysfs attributes)
+
+	struct rw_semaphore remove_lock;	// held for reading by file operations that use the bus thread
+	bool removed;				// set, with remove_lock held for writing, once removal starts
+
+	struct klcd_pins pins;
+	bool rw_wired;				// the R/W line is connected, so the LCD can be read
+	unsigned int rows;
+	unsigned int columns;
+	unsigned int cells;			// rows * columns
+	const struct klcd_transport *transport;	// the transport in use
+	struct klcd_emul emul;			// the emulated controller, for the emul transport
+
+	struct klcd_timing timing;		// bus timing in use
+	bool timing_calibrated;			// timing was found by a calibration
+	int calibrate_result;			// result of the last calibration, returned to its caller
+	unsigned int calibrate_recoveries;	// calibration steps the LCD failed, each followed by a new initialization
+
+	// shadow buffer, see "Shadow Buffer" in klcd.c
+	char shadow[LCD_MAX_CELLS];		// character codes currently shown, line 1 first
+	unsigned int address;			// DDRAM or CGRAM address counter of the controller
+	bool address_cgram;			// the address counter points to CGRAM
+	bool cursor_visible;			// cursor and blinking are on
+	u8 cgram_shadow[LCD_CGRAM_SIZE];	// rows of the CGRAM glyphs, for the state snapshot
+	DECLARE_BITMAP(shadow_unknown, LCD_MAX_CELLS);	// cells not known since a warm attach
+	struct mutex mutex;			// serializes users of the bus. shadow, address and cgram_shadow
+						// are only written with it held
+	seqlock_t shadow_lock;			// taken around writes to shadow and shadow_unknown, so readers
+						// can copy them without waiting for the bus
+	unsigned long plan_stats[KLCD_MOVE_COUNT];	// moves made by the planner, per kind
+
+	// update queue and bus thread
+	struct llist_head inbox[LCD_NUM_PRIORITIES];	// submitted updates, newest first, one list per priority
+	struct list_head lanes[LCD_NUM_PRIORITIES];	// updates taken from the inboxes, oldest first, bus thread only
+	atomic_t queued_async;			// async updates not applied yet
+	atomic_t update_seq;			// sequence number of the last update submitted
+	u32 cell_seq[LCD_MAX_CELLS];		// sequence number of the update that last wrote each cell, bus thread only
+	struct task_struct *bus_task;		// the bus thread
+	wait_queue_head_t bus_wait;		// the bus thread waits here for work
+	bool bus_kick;				// wake the bus thread to re-read its settings
+	struct klcd_bus_stats bus_stats;	// written by the bus thread only
+
+	// scrubber
+	unsigned int scrub_interval;		// time between two passes in ms, 0 if disabled
+	unsigned int scrub_cells;		// cells checked per pass
+	unsigned int scrub_next;		// first cell of the next pass
+	unsigned long scrub_repaired;		// cells found corrupted and rewritten
+	unsigned long scrub_due;		// jiffies of the next pass
+
+	// CGRAM allocator, protected by cgram_lock (taken after mutex)
+	struct klcd_cgram_slot cgram_slots[LCD_CGRAM_GLYPHS];
+	struct mutex cgram_lock;
+	u8 cgram_rows[LCD_CGRAM_SIZE];		// bitmaps the glyphs should have
+	unsigned int cgram_dirty;		// glyphs whose bitmap the bus thread still has to send (bit n for glyph n)
+	unsigned int cgram_queued;		// glyphs handed out for text that may still be queued, kept until the
+						// bus thread has nothing left to do
+	unsigned int cgram_submitters;		// callers between lcd_translate_begin() and lcd_translate_end()
+
+	// widgets, protected by widget_lock (taken before cgram_lock)
+	struct mutex widget_lock;
+	struct klcd_widget widgets[KLCD_MAX_WIDGETS];
+	unsigned int num_bargraphs;		// defined bargraphs, which pin the bar glyphs
+	char bar_codes[LCD_BAR_STEPS + 1];	// character code for 0 to 5 filled columns
+
+	// playlist
+	struct klcd_play play;
+	struct mutex play_lock;			// protects play, taken before mutex
+	struct hrtimer play_timer;
+	bool play_due;				// set by the timer, cleared by the bus thread
+
+	// terminal
+	DECLARE_KFIFO(term_fifo, char, LCD_TERM_FIFO_SIZE);	// single producer (term_lock), single consumer (bus thread)
+	struct mutex term_lock;			// one writer at a time, so writes are not interleaved
+	wait_queue_head_t term_wait;		// writers and pollers wait here for room
+	unsigned int term_column;		// cursor on the bottom line, bus thread only
+	bool term_newline;			// a '\n' scrolls up before the next printable character, bus thread only
+	char term_partial[4];			// a UTF-8 sequence cut off at the end of a chunk
+	unsigned int term_partial_len;
+};
+
+// ********* Function Prototypes *******************************************************************
+
+static int  lcd_pin_setup(unsigned int pin_number);
+static int  lcd_pin_setup_All(struct klcd_device *lcd);
+static void lcd_pin_release(unsigned int pin_number);
+static void lcd_pin_release_All(struct klcd_device *lcd);
+
+
+static void lcd_instruction(struct klcd_device *lcd, char command);
+static void lcd_command(struct klcd_device *lcd, char command);
+static void lcd_data(struct klcd_device *lcd, char data);
+static void lcd_data_bulk(struct klcd_device *lcd, const char * data, unsigned int count);
+static int  lcd_read_cells(struct klcd_device *lcd, unsigned int cell, char * data, unsigned int count);
+static void lcd_initialize(struct klcd_device *lcd);
+static void lcd_print(struct klcd_device *lcd, char * msg, unsigned int lineNumber, unsigned int priority);
+static void lcd_print_WithPosition(struct klcd_device *lcd, char * msg, unsigned int lineNumber, unsigned int nthCharacter, unsigned int priority);
+
+static void lcd_setPosition(struct klcd_device *lcd, unsigned int line, unsigned int nthCharacter);
+static unsigned int lcd_cell_address(struct klcd_device *lcd, unsigned int cell);
+static int  lcd_address_ring(unsigned int address);
+static void lcd_address_step(struct klcd_device *lcd, bool increment);
+static void lcd_plan_seek(struct klcd_device *lcd, unsigned int cell);
+static void lcd_update_cells(struct klcd_device *lcd, unsigned int cell, const char * text, unsigned int count);
+
+static int  lcd_queue_init(struct klcd_device *lcd);
+static void lcd_queue_exit(struct klcd_device *lcd);
+static void lcd_queue_submit(struct klcd_device *lcd, struct klcd_update *update);
+static void lcd_queue_text(struct klcd_device *lcd, unsigned int cell, const char * text, unsigned int count, unsigned int priority);
+static void lcd_queue_command(struct klcd_device *lcd, void (*command)(struct klcd_device *lcd), unsigned int priority);
+static void lcd_queue_command_wait(struct klcd_device *lcd, void (*command)(struct klcd_device *lcd), unsigned int priority);
+static void lcd_queue_flush(struct klcd_device *lcd);
+static void lcd_queue_run(struct klcd_device *lcd);
+static void lcd_bus_record_timing(struct klcd_device *lcd, ktime_t start, unsigned int target_ns);
+static void lcd_bus_wake(struct klcd_device *lcd);
+
+static int  lcd_scrub_pass(struct klcd_device *lcd);
+static long lcd_scrub_run(struct klcd_device *lcd);
+static void lcd_scrub_set_interval(struct klcd_device *lcd, unsigned int interval);
+static int  lcd_calibrate_run(struct klcd_device *lcd);
+static bool lcd_cell_differs(struct klcd_device *lcd, unsigned int cell, char code);
+static void lcd_warm_attach(struct klcd_device *lcd);
+static void lcd_clearDisplay(struct klcd_device *lcd);
+
+static int  lcd_rom_build(void);
+static u16  lcd_rom_lookup(u32 codepoint);
+static int  lcd_cgram_reclaim(struct klcd_device *lcd, unsigned int claimed);
+static int  lcd_cgram_glyph(struct klcd_device *lcd, u32 codepoint, unsigned int *claimed);
+static int  lcd_cgram_load(struct klcd_device *lcd, u32 codepoint, const u8 *rows, unsigned int *claimed);
+static int  lcd_cgram_pin(struct klcd_device *lcd, u32 codepoint, const u8 *rows);
+static void lcd_cgram_unpin(struct klcd_device *lcd, u32 codepoint);
+static void lcd_cgram_reset(struct klcd_device *lcd);
+static int  lcd_cgram_redefine(struct klcd_device *lcd, u32 codepoint, const u8 *rows);
+static void lcd_cgram_sync(struct klcd_device *lcd);
+static void lcd_cgram_settle(struct klcd_device *lcd);
+static void lcd_translate_begin(struct klcd_device *lcd);
+static void lcd_translate_end(struct klcd_device *lcd);
+static void lcd_translate(struct klcd_device *lcd, char * msg);
+
+static unsigned int lcd_utf8_decode(const char *s, unsigned int len, u32 *codepoint);
+
+static void lcd_play_init(struct klcd_device *lcd);
+static void lcd_play_exit(struct klcd_device *lcd);
+static bool lcd_play_pending(struct klcd_device *lcd);
+static void lcd_play_run(struct klcd_device *lcd);
+static int  lcd_play_load(struct klcd_device *lcd, const struct klcd_playlist *list);
+
+static bool lcd_term_pending(struct klcd_device *lcd);
+static void lcd_term_run(struct klcd_device *lcd);
+static int  klcd_source_copy(struct klcd_source *source, char *kbuf, size_t count);
+
+static int  lcd_widget_define(struct klcd_device *lcd, const struct klcd_widget_def *def, unsigned int priority);
+static int  lcd_widget_set(struct klcd_device *lcd, const struct klcd_widget_value *value, unsigned int priority);
+
+static void lcd_cursor_on(struct klcd_device *lcd);
+static void lcd_cursor_off(struct klcd_device *lcd);
 
 #endif